@@ -0,0 +1,77 @@
+#include <query.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <string>
+
+using namespace siesta;
+
+namespace
+{
+    // The regex based parser previously used by the server
+    void parseRegex(const std::string& uri,
+                    std::map<std::string, std::string>& queries)
+    {
+        auto q_pos = uri.find('?');
+        if (q_pos != std::string::npos) {
+            const std::regex r("([^=&]+)=([^=&]+)");
+            std::smatch m;
+            std::string::const_iterator searchStart(uri.cbegin() + q_pos + 1);
+            while (std::regex_search(searchStart, uri.cend(), m, r)) {
+                queries.insert(std::make_pair(m[1].str(), m[2].str()));
+                searchStart = m.suffix().first;
+            }
+        }
+    }
+
+    void parseDirect(const std::string& uri,
+                     std::map<std::string, std::string>& queries)
+    {
+        auto q_pos = uri.find('?');
+        if (q_pos != std::string::npos) {
+            std::string key, value;
+            detail::forEachQuery(
+                uri.data() + q_pos + 1,
+                uri.size() - q_pos - 1,
+                [&](const char* k, size_t k_len, const char* v, size_t v_len) {
+                    detail::decodeQueryComponent(k, k_len, key);
+                    detail::decodeQueryComponent(v, v_len, value);
+                    queries.insert(std::make_pair(key, value));
+                });
+        }
+    }
+
+    template <class Fn>
+    double run(const char* name, const std::string& uri, int iterations, Fn fn)
+    {
+        size_t total = 0;
+        auto start   = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            std::map<std::string, std::string> queries;
+            fn(uri, queries);
+            total += queries.size();
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(
+                           std::chrono::steady_clock::now() - start)
+                           .count() /
+                       iterations;
+        std::cout << name << ": " << elapsed << " ns/request (" << total
+                  << " queries)" << std::endl;
+        return elapsed;
+    }
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    const int iterations = argc > 1 ? std::stoi(argv[1]) : 100000;
+    const std::string uri =
+        "/api/v1/items?offset=100&limit=25&sort=name&order=desc"
+        "&filter=color%3Dred&session=4f1c2a9e8b7d6c5e";
+
+    const double regex = run("regex ", uri, iterations, parseRegex);
+    const double direct = run("direct", uri, iterations, parseDirect);
+    std::cout << "speedup: " << regex / direct << "x" << std::endl;
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <siesta/client.h>
+#include <siesta/server.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace siesta;
+
+namespace
+{
+    // Server side connections, for sending to each one in turn
+    struct Connections {
+        std::mutex mutex;
+        std::vector<server::websocket::Writer*> writers;
+    };
+
+    struct Connection : server::websocket::Reader {
+        Connections& owner;
+        server::websocket::Writer& writer;
+        Connection(Connections& o, server::websocket::Writer& w)
+            : owner(o), writer(w)
+        {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            owner.writers.push_back(&writer);
+        }
+        ~Connection()
+        {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            for (auto it = owner.writers.begin(); it != owner.writers.end();
+                 ++it) {
+                if (*it == &writer) {
+                    owner.writers.erase(it);
+                    break;
+                }
+            }
+        }
+        void onMessage(const std::string&) override {}
+    };
+
+    // Bytes received by all clients
+    struct Received {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t bytes{0};
+
+        void add(size_t n)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bytes += n;
+            cv.notify_one();
+        }
+
+        size_t total()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return bytes;
+        }
+
+        bool waitFor(size_t total)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return cv.wait_for(lock, std::chrono::seconds(60), [&] {
+                return bytes >= total;
+            });
+        }
+    };
+
+    template <class Fn>
+    double run(const char* name,
+               Received& received,
+               size_t num_clients,
+               int num_messages,
+               size_t message_size,
+               Fn send)
+    {
+        const size_t start_bytes = received.total();
+        const auto start         = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_messages; ++i) {
+            send();
+        }
+        const bool complete = received.waitFor(
+            start_bytes + num_clients * num_messages * message_size);
+        const double elapsed = std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count();
+        std::cout << name << ": " << elapsed << " ms for " << num_messages
+                  << " messages to " << num_clients << " clients"
+                  << (complete ? "" : " (incomplete)") << std::endl;
+        return elapsed;
+    }
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t num_clients = argc > 1 ? std::stoul(argv[1]) : 500;
+    const int num_messages   = argc > 2 ? std::stoi(argv[2]) : 200;
+    const size_t message_size = 256;
+
+    auto server = server::createServer("http://127.0.0.1:8090");
+    server->start();
+    const std::string url = "ws://127.0.0.1:8090/feed";
+
+    Connections connections;
+    auto group = server::websocket::createGroup();
+    server::TokenHolder holder;
+    holder += server->addBinaryWebsocket(
+        "/feed", [&](server::websocket::Writer& w) {
+            group->add(w);
+            return new Connection(connections, w);
+        });
+
+    Received received;
+    std::vector<std::unique_ptr<client::websocket::Writer>> clients;
+    for (size_t i = 0; i < num_clients; ++i) {
+        clients.push_back(client::websocket::connect(
+            url, [&](client::websocket::Writer&, const std::string& data) {
+                received.add(data.size());
+            }));
+    }
+    while (group->size() < num_clients) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    const std::string message(message_size, 'm');
+    const double loop = run(
+        "send loop", received, num_clients, num_messages, message_size, [&] {
+            // A copy per connection
+            std::lock_guard<std::mutex> lock(connections.mutex);
+            for (auto writer : connections.writers) {
+                writer->send(message);
+            }
+        });
+    const double broadcast = run(
+        "broadcast", received, num_clients, num_messages, message_size, [&] {
+            // One shared payload
+            group->broadcast(std::make_shared<const std::string>(message));
+        });
+    std::cout << "speedup: " << loop / broadcast << "x" << std::endl;
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <siesta/client.h>
+#include <siesta/server.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace siesta;
+
+namespace
+{
+    struct Connection : server::websocket::Reader {
+        std::atomic<size_t>& count;
+        Connection(std::atomic<size_t>& c) : count(c) { ++count; }
+        ~Connection() { --count; }
+        void onMessage(const std::string&) override {}
+    };
+
+    // Resident set size of the process in kB, or 0 if unknown
+    size_t residentKb()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmRSS:") == 0) {
+                return std::stoul(line.substr(6));
+            }
+        }
+        return 0;
+    }
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t num_clients = argc > 1 ? std::stoul(argv[1]) : 1000;
+
+    auto server = server::createServer("http://127.0.0.1:8091");
+    server->start();
+    const std::string url = "ws://127.0.0.1:8091/idle";
+
+    std::atomic<size_t> connected(0);
+    server::TokenHolder holder;
+    holder += server->addBinaryWebsocket(
+        "/idle", [&](server::websocket::Writer&) {
+            return new Connection(connected);
+        });
+
+    // Warm up, so the worker threads and nng are set up before measuring
+    {
+        auto client = client::websocket::connect(
+            url, [](client::websocket::Writer&, const std::string&) {});
+        client->send("warm up");
+    }
+    while (connected > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    const size_t before = residentKb();
+    if (before == 0) {
+        std::cout << "RSS is not available on this platform" << std::endl;
+    }
+    std::vector<std::unique_ptr<client::websocket::Writer>> clients;
+    for (size_t i = 0; i < num_clients; ++i) {
+        clients.push_back(client::websocket::connect(
+            url, [](client::websocket::Writer&, const std::string&) {}));
+    }
+    while (connected < num_clients) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // Let the connections settle
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    const size_t after = residentKb();
+
+    // Both ends of each connection live in this process
+    std::cout << num_clients << " idle connections: " << (after - before)
+              << " kB, " << (after - before) * 1024 / num_clients
+              << " bytes per connection (server and client end)"
+              << std::endl;
+    return 0;
+}
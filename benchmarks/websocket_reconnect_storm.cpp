@@ -0,0 +1,86 @@
+#include <siesta/client.h>
+#include <siesta/server.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace siesta;
+
+namespace
+{
+    struct Connection : server::websocket::Reader {
+        std::atomic<size_t>& count;
+        Connection(std::atomic<size_t>& c) : count(c) { ++count; }
+        ~Connection() { --count; }
+        void onMessage(const std::string&) override {}
+    };
+}  // namespace
+
+// Time until all of a crowd of clients, connecting at once, are connected.
+// Mind the limit of open files, each connection takes two.
+int main(int argc, char** argv)
+{
+    const size_t num_clients = argc > 1 ? std::stoul(argv[1]) : 20000;
+    const size_t num_accepts = argc > 2 ? std::stoul(argv[2]) : 4;
+    const size_t num_threads = argc > 3 ? std::stoul(argv[3]) : 32;
+
+    auto server = server::createServer("http://127.0.0.1:8092");
+    server->start();
+    const std::string url = "ws://127.0.0.1:8092/storm";
+
+    std::atomic<size_t> connected(0);
+    server::websocket::Options options;
+    options.num_pending_accepts = num_accepts;
+    server::TokenHolder holder;
+    holder += server->addBinaryWebsocket(
+        "/storm",
+        [&](server::websocket::Writer&) { return new Connection(connected); },
+        options);
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<client::websocket::Writer>> clients;
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&] {
+            while (next++ < num_clients) {
+                try {
+                    auto client = client::websocket::connect(
+                        url,
+                        [](client::websocket::Writer&, const std::string&) {});
+                    std::lock_guard<std::mutex> lock(mutex);
+                    clients.push_back(std::move(client));
+                } catch (std::exception&) {
+                    ++failed;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const size_t expected = num_clients - failed;
+    while (connected < expected &&
+           std::chrono::steady_clock::now() - start < std::chrono::minutes(1)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double elapsed = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+
+    std::cout << connected << " of " << num_clients << " clients connected in "
+              << elapsed << " ms, " << num_accepts << " pending accepts";
+    if (failed > 0) {
+        std::cout << ", " << failed << " failed to connect";
+    }
+    std::cout << std::endl;
+    return 0;
+}
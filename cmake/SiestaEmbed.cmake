@@ -0,0 +1,192 @@
+# siesta_embed_directory(<target> <name> <directory>)
+#
+# Compiles the files of <directory> into <target>, for single binary
+# deployments. The files are accessed through a generated function
+#
+#   const siesta::embedded::Directory& <name>();
+#
+# declared in the generated header "<name>.h", and served with
+# Server::addEmbeddedDirectory. <name> must be a valid C++ identifier.
+#
+# Every file gets a precomputed ETag, and gzip/brotli compressed variants if
+# smaller than the file. Variants are taken from precompressed siblings
+# ("file.gz", "file.br") if present, else compressed at build time by the
+# gzip and brotli tools, if found. The sources are regenerated when an
+# embedded file changes.
+#
+# This file is also the generator script, run at build time in script mode.
+
+if (NOT CMAKE_SCRIPT_MODE_FILE)
+    set(SIESTA_EMBED_SCRIPT ${CMAKE_CURRENT_LIST_FILE} CACHE INTERNAL "")
+
+    function(siesta_embed_directory target name directory)
+        get_filename_component(directory "${directory}" ABSOLUTE)
+        set(glob_options)
+        if (NOT CMAKE_VERSION VERSION_LESS 3.12)
+            # Pick up added and removed files without re-running CMake
+            set(glob_options CONFIGURE_DEPENDS)
+        endif()
+        file(GLOB_RECURSE files ${glob_options} "${directory}/*")
+
+        find_program(SIESTA_GZIP_EXECUTABLE gzip)
+        find_program(SIESTA_BROTLI_EXECUTABLE brotli)
+        mark_as_advanced(SIESTA_GZIP_EXECUTABLE SIESTA_BROTLI_EXECUTABLE)
+
+        set(output_dir ${CMAKE_CURRENT_BINARY_DIR}/siesta_embedded)
+        set(source ${output_dir}/${name}.cpp)
+        set(header ${output_dir}/${name}.h)
+        add_custom_command(
+            OUTPUT ${source} ${header}
+            COMMAND ${CMAKE_COMMAND}
+                -DNAME=${name}
+                -DDIRECTORY=${directory}
+                -DOUTPUT_DIR=${output_dir}
+                -DGZIP=${SIESTA_GZIP_EXECUTABLE}
+                -DBROTLI=${SIESTA_BROTLI_EXECUTABLE}
+                -P ${SIESTA_EMBED_SCRIPT}
+            DEPENDS ${files} ${SIESTA_EMBED_SCRIPT}
+            COMMENT "Embedding ${directory}"
+            VERBATIM
+        )
+        target_sources(${target} PRIVATE ${source} ${header})
+        target_include_directories(${target} PRIVATE ${output_dir})
+    endfunction()
+    return()
+endif()
+
+# Script mode: generate ${OUTPUT_DIR}/${NAME}.cpp and ${OUTPUT_DIR}/${NAME}.h
+# from the files of ${DIRECTORY}
+cmake_minimum_required(VERSION 3.11.4)
+
+# Set <var> to the C++ initializer of the bytes of a file, and <size_var> to
+# the size of the file
+function(siesta_embed_bytes path var size_var)
+    file(READ "${path}" hex HEX)
+    string(LENGTH "${hex}" length)
+    math(EXPR size "${length} / 2")
+    if (size EQUAL 0)
+        # Arrays can't be empty
+        set(bytes "0")
+    else()
+        string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+        # 12 bytes a line
+        set(line "0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,")
+        string(REGEX REPLACE "${line}" "\\0\n        " bytes "${bytes}")
+    endif()
+    set(${var} "${bytes}" PARENT_SCOPE)
+    set(${size_var} ${size} PARENT_SCOPE)
+endfunction()
+
+# Set <var> to a C++ string literal of a string
+function(siesta_embed_literal string var)
+    string(REPLACE "\\" "\\\\" string "${string}")
+    string(REPLACE "\"" "\\\"" string "${string}")
+    set(${var} "\"${string}\"" PARENT_SCOPE)
+endfunction()
+
+file(MAKE_DIRECTORY ${OUTPUT_DIR})
+file(GLOB_RECURSE files RELATIVE ${DIRECTORY} "${DIRECTORY}/*")
+list(SORT files)
+set(temp ${OUTPUT_DIR}/${NAME}.tmp)
+
+set(arrays "")
+set(entries "")
+set(index 0)
+foreach(file ${files})
+    set(path ${DIRECTORY}/${file})
+    # CMAKE_MATCH_1 is only set once the match has been evaluated, so it
+    # can't be used in the same condition
+    if (file MATCHES "^(.*)\\.(gz|br)$")
+        if (EXISTS ${DIRECTORY}/${CMAKE_MATCH_1})
+            # Precompressed sibling, embedded as a variant
+            continue()
+        endif()
+    endif()
+
+    siesta_embed_bytes(${path} bytes size)
+    string(APPEND arrays
+        "    constexpr unsigned char data${index}[] = {\n        ${bytes}};\n")
+
+    # Variants, only if smaller
+    foreach(coding gzip brotli)
+        if (coding STREQUAL "gzip")
+            set(variant ${path}.gz)
+            set(tool ${GZIP})
+            set(arguments -9 -n -c)
+        else()
+            set(variant ${path}.br)
+            set(tool ${BROTLI})
+            set(arguments -q 11 -c)
+        endif()
+        set(${coding}_entry "nullptr, 0")
+        if (NOT EXISTS ${variant})
+            set(variant "")
+            if (tool)
+                execute_process(
+                    COMMAND ${tool} ${arguments} ${path}
+                    OUTPUT_FILE ${temp}
+                    RESULT_VARIABLE result
+                )
+                if (result EQUAL 0)
+                    set(variant ${temp})
+                endif()
+            endif()
+        endif()
+        if (variant)
+            siesta_embed_bytes(${variant} variant_bytes variant_size)
+            if (variant_size LESS size)
+                string(APPEND arrays
+                    "    constexpr unsigned char ${coding}${index}[] = {\n"
+                    "        ${variant_bytes}};\n")
+                set(${coding}_entry "${coding}${index}, ${variant_size}")
+            endif()
+        endif()
+    endforeach()
+
+    # Strong ETag, from the content
+    file(SHA1 ${path} hash)
+    string(SUBSTRING ${hash} 0 16 hash)
+    siesta_embed_literal(${file} path_literal)
+    siesta_embed_literal("\"${hash}\"" etag_literal)
+    string(APPEND entries
+        "        {${path_literal},\n"
+        "         data${index},\n"
+        "         ${size},\n"
+        "         ${etag_literal},\n"
+        "         ${gzip_entry},\n"
+        "         ${brotli_entry}},\n")
+    math(EXPR index "${index} + 1")
+endforeach()
+file(REMOVE ${temp})
+
+if (index EQUAL 0)
+    set(directory "{nullptr, 0}")
+else()
+    string(APPEND arrays
+        "    constexpr siesta::embedded::File files[] = {\n${entries}    };\n")
+    set(directory "{files, ${index}}")
+endif()
+
+file(WRITE ${OUTPUT_DIR}/${NAME}.h
+"// Generated by siesta_embed_directory, do not edit
+#pragma once
+
+#include <siesta/embedded.h>
+
+const siesta::embedded::Directory& ${NAME}();
+")
+
+file(WRITE ${OUTPUT_DIR}/${NAME}.cpp
+"// Generated by siesta_embed_directory, do not edit
+#include \"${NAME}.h\"
+
+namespace
+{
+${arrays}}  // namespace
+
+const siesta::embedded::Directory& ${NAME}()
+{
+    static const siesta::embedded::Directory directory = ${directory};
+    return directory;
+}
+")
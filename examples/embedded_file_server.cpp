@@ -0,0 +1,45 @@
+#include <siesta/server.h>
+using namespace siesta;
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "ctrl_c_handler.h"
+
+// Generated from the embedded_www directory, see CMakeLists.txt
+#include "example_assets.h"
+
+int main(int argc, char** argv)
+{
+    ctrlc::set_signal_handler();
+    try {
+        auto server = server::createServer("http://127.0.0.1");
+        server->start();
+        std::cout << "HTTP Server started, listening on port " << server->port()
+                  << std::endl;
+
+        server::TokenHolder h;
+        // Served from memory, nothing to ship next to the executable
+        server::DirectoryOptions options;
+        options.cache_control = "no-cache";
+        h += server->addEmbeddedDirectory("/", example_assets(), options);
+
+        int counter = 1;
+        h += server->addRoute(HttpMethod::GET,
+                              "/rest/test",
+                              [&counter](const server::rest::Request&,
+                                         server::rest::Response& resp) {
+                                  resp.setBody(std::to_string(counter++));
+                              });
+
+        while (!ctrlc::signalled()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::cout << "Server stopped!" << std::endl;
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
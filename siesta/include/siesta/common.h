@@ -1,5 +1,12 @@
 #pragma once
 
+#include <cstring>
+#include <string>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
 #if __cplusplus >= 201703L
 #define NO_DISCARD [[nodiscard]]
 #else
@@ -84,6 +91,46 @@ namespace siesta
         NETWORK_AUTH_REQUIRED    = 511,
     };
 
+    /**
+     * Non-owning reference to a string, a C++11 stand-in for
+     * std::string_view. Converts to std::string_view when compiled as C++17.
+     */
+    class string_view
+    {
+        const char* data_{nullptr};
+        size_t size_{0};
+
+    public:
+        string_view() = default;
+        string_view(const char* s) : data_(s), size_(s ? strlen(s) : 0) {}
+        string_view(const char* s, size_t size) : data_(s), size_(size) {}
+        string_view(const std::string& s) : data_(s.data()), size_(s.size())
+        {
+        }
+
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+        size_t length() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const char* begin() const { return data_; }
+        const char* end() const { return data_ + size_; }
+        char operator[](size_t i) const { return data_[i]; }
+
+        std::string str() const { return std::string(data_, size_); }
+        explicit operator std::string() const { return str(); }
+#if __cplusplus >= 201703L
+        operator std::string_view() const { return {data_, size_}; }
+#endif
+    };
+
+    inline bool operator==(string_view a, string_view b)
+    {
+        return a.size() == b.size() &&
+               (a.size() == 0 || memcmp(a.data(), b.data(), a.size()) == 0);
+    }
+
+    inline bool operator!=(string_view a, string_view b) { return !(a == b); }
+
     std::string method_to_string(const HttpMethod method);
     HttpMethod string_to_method(const std::string& method);
 
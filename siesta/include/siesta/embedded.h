@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+
+namespace siesta
+{
+    namespace embedded
+    {
+        /**
+         * A file compiled into the executable. Instances are generated by
+         * the siesta_embed_directory CMake function, see
+         * cmake/SiestaEmbed.cmake.
+         */
+        struct File {
+            /** Path relative to the embedded directory, '/' separated */
+            const char* path;
+            const unsigned char* data;
+            size_t size;
+            /** Strong ETag, including quotes */
+            const char* etag;
+            /** Gzip compressed content, nullptr if none */
+            const unsigned char* gzip_data;
+            size_t gzip_size;
+            /** Brotli compressed content, nullptr if none */
+            const unsigned char* brotli_data;
+            size_t brotli_size;
+        };
+
+        /**
+         * Files of an embedded directory, see Server::addEmbeddedDirectory
+         */
+        struct Directory {
+            const File* files;
+            size_t count;
+        };
+    }  // namespace embedded
+}  // namespace siesta
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
@@ -7,6 +8,7 @@
 #include <vector>
 
 #include "common.h"
+#include "embedded.h"
 
 namespace siesta
 {
@@ -18,6 +20,9 @@ namespace siesta
             virtual ~Token() = default;
         };
 
+        /** Immutable, shareable payload */
+        using Payload = std::shared_ptr<const std::string>;
+
         class TokenHolder
         {
             std::vector<std::unique_ptr<Token>> routes_;
@@ -29,20 +34,74 @@ namespace siesta
 
         namespace rest
         {
+            /** Options of a REST route */
+            struct RouteOptions {
+                /**
+                 * Largest accepted request body, in bytes. Larger requests are
+                 * answered with "413 Payload Too Large".
+                 */
+                size_t max_body_size{128 * 1024};
+
+                /**
+                 * If true, the handler is called as soon as the request
+                 * headers are received, and reads the body itself, in parts,
+                 * with Request::readBody. As readBody blocks, this needs a
+                 * server created with callback_on_worker_thread; adding such
+                 * a route to any other server throws std::invalid_argument.
+                 */
+                bool stream_body{false};
+            };
+
             class Request
             {
             public:
+                using QueryList =
+                    std::vector<std::pair<std::string, std::string>>;
+
                 virtual ~Request()                         = default;
                 virtual const std::string& getUri() const  = 0;
                 virtual const HttpMethod getMethod() const = 0;
                 virtual const std::map<std::string, std::string>&
                 getUriParameters() const = 0;
+                // Percent decoded queries. Keys without value map to an empty
+                // string. For repeated keys, the first value is used.
                 virtual const std::map<std::string, std::string>& getQueries()
-                    const                                                   = 0;
+                    const = 0;
+                // All percent decoded queries, in order of appearance
+                // (including repeated keys)
+                virtual const QueryList& getQueryList() const               = 0;
                 virtual std::string getHeader(const std::string& key) const = 0;
                 virtual std::string getBody() const                         = 0;
+                // Read the next part of the body into buf, blocking until
+                // data is available. Returns the number of bytes read, zero at
+                // the end of the body. This is the only way to get the body of
+                // a route with RouteOptions::stream_body set, whose handler
+                // runs on a worker thread.
+                virtual size_t readBody(void* buf, size_t size) const = 0;
+
+                // Non-owning views into the request. They are only valid
+                // during the handler call (or until an asynchronous request
+                // is completed).
+
+                // The URI, including query
+                virtual string_view getUriView() const = 0;
+                // The URI, without query
+                virtual string_view getPathView() const = 0;
+                // Empty if there is no such URI parameter
+                virtual string_view getUriParameterView(
+                    string_view key) const = 0;
+                // Empty if there is no such header
+                virtual string_view getHeaderView(const char* key) const = 0;
+                virtual string_view getBodyView() const                  = 0;
             };
 
+            /**
+             * Produces a streamed response body, one chunk at a time. Set
+             * chunk to the next part of the body and return true, or return
+             * false at the end of the body.
+             */
+            using BodySource = std::function<bool(std::string& chunk)>;
+
             class Response
             {
             public:
@@ -52,10 +111,51 @@ namespace siesta
                 // Set the body of the response
                 virtual void setBody(const void* data, size_t size) = 0;
                 virtual void setBody(const std::string& data)       = 0;
+                // Set the body of the response, taking ownership of the data
+                // instead of copying it
+                virtual void setBody(std::string&& data)          = 0;
+                virtual void setBody(std::vector<uint8_t>&& data) = 0;
+                // Set the body of the response, without copying. The payload
+                // may be shared by any number of responses.
+                virtual void setBody(Payload data) = 0;
+                // Stream the body of the response. The source is called for
+                // the next chunk once the previous one has been written, so
+                // only one chunk is held at a time. Without a length, the body
+                // is sent with chunked transfer encoding. A source throwing,
+                // or not matching the length, aborts the connection.
+                virtual void setBodySource(BodySource source,
+                                           int64_t length = -1) = 0;
             };
 
             using Handler =
                 std::function<void(const rest::Request&, rest::Response&)>;
+
+            /**
+             * Completion of an asynchronous request. The response is sent
+             * when the completion is finished, which may be done from any
+             * thread. If the last reference to an unfinished completion is
+             * released, "500 Internal Server Error" is sent.
+             */
+            class Completion
+            {
+            public:
+                virtual ~Completion() = default;
+                // Send the response. Only the first finish/fail has effect.
+                virtual void finish() = 0;
+                // Send an error response instead of the response
+                virtual void fail(HttpStatus status,
+                                  const std::string& reason = "") = 0;
+            };
+
+            /**
+             * Handler for asynchronous requests. The request and response
+             * objects remain valid until the completion is finished, and
+             * must not be accessed afterwards.
+             */
+            using AsyncHandler =
+                std::function<void(const rest::Request&,
+                                   rest::Response&,
+                                   std::shared_ptr<rest::Completion>)>;
         }  // namespace rest
 
         namespace websocket
@@ -76,14 +176,240 @@ namespace siesta
             class Writer
             {
             public:
-                virtual ~Writer()                          = default;
+                /**
+                 * Called once a message has been sent, with false if it
+                 * couldn't be (f.i. as the connection closed). Called from a
+                 * network thread, so it should return quickly.
+                 */
+                using SendCallback = std::function<void(bool sent)>;
+
+                virtual ~Writer() = default;
+
+                /**
+                 * Queue a message, and return without waiting for it to be
+                 * sent. Messages are sent in the order queued. Safe to call
+                 * from any thread.
+                 */
                 virtual void send(const std::string& data) = 0;
+
+                /**
+                 * Queue a message, with a callback for when it has been sent
+                 */
+                virtual void send(const std::string& data,
+                                  SendCallback done) = 0;
+
+                /**
+                 * Queue a shared message, without copying it. The payload is
+                 * kept alive until sent.
+                 */
+                virtual void send(Payload data,
+                                  SendCallback done = nullptr) = 0;
+
+                /**
+                 * Queue a shared message with a key, f.i. the topic it
+                 * updates. With the Coalesce overflow policy, it replaces a
+                 * queued message of the same key. Otherwise the same as
+                 * send().
+                 */
+                virtual void sendKeyed(const std::string& key,
+                                       Payload data,
+                                       SendCallback done = nullptr) = 0;
+            };
+
+            /**
+             * A set of websocket connections, f.i. the subscribers of a
+             * topic, to send the same message to. Connections leave their
+             * groups when closed. Safe to use from any thread.
+             */
+            class Group
+            {
+            public:
+                virtual ~Group() = default;
+
+                /**
+                 * Add a connection, by the writer passed to the websocket
+                 * factory. May be called from the factory.
+                 */
+                virtual void add(Writer& writer) = 0;
+
+                virtual void remove(Writer& writer) = 0;
+
+                /** Number of connections in the group */
+                virtual size_t size() const = 0;
+
+                /**
+                 * Queue a message to all connections in the group, without
+                 * waiting for it to be sent. The payload is shared by all
+                 * connections, not copied. Each connection applies its own
+                 * overflow policy. With OverflowPolicy::Block, the message
+                 * is queued to the connections with room first, then this
+                 * waits for room at the full ones.
+                 *
+                 * @returns The number of connections the message was queued
+                 * to
+                 */
+                virtual size_t broadcast(Payload data) = 0;
+
+                /**
+                 * Queue a message with a key to all connections in the
+                 * group, see Writer::sendKeyed and broadcast
+                 *
+                 * @returns The number of connections the message was queued
+                 * to
+                 */
+                virtual size_t broadcastKeyed(const std::string& key,
+                                              Payload data) = 0;
             };
 
-            /** Websocket handler factory type */
+            /** Creates an empty group */
+            std::shared_ptr<Group> createGroup();
+
+            /**
+             * Websocket handler factory type. Calls for one endpoint are
+             * serialized, calls for different endpoints may overlap.
+             */
             using Factory = std::function<Reader*(Writer&)>;
+
+            /**
+             * What to do with a message sent to a connection whose outbound
+             * queue is full, f.i. as the client reads slower than it is
+             * sent to
+             */
+            enum class OverflowPolicy {
+                /**
+                 * Wait in send() for room in the queue. Don't send from
+                 * handlers called on nng threads with this policy.
+                 */
+                Block,
+                /** Drop the message sent */
+                DropNewest,
+                /** Drop the oldest queued messages, to make room */
+                DropOldest,
+                /**
+                 * A keyed message replaces the queued message of the same
+                 * key, full or not. Otherwise the same as DropOldest.
+                 */
+                Coalesce,
+                /** Close the connection */
+                Disconnect
+            };
+
+            /**
+             * Counts of the overflow policy actions taken, for all
+             * connections of an endpoint
+             */
+            struct OverflowCounters {
+                /** Sends that waited for room */
+                std::atomic<uint64_t> blocked{0};
+                std::atomic<uint64_t> dropped_newest{0};
+                std::atomic<uint64_t> dropped_oldest{0};
+                /** Queued messages replaced by a message of the same key */
+                std::atomic<uint64_t> coalesced{0};
+                std::atomic<uint64_t> disconnected{0};
+            };
+
+            /**
+             * Options of a websocket endpoint
+             */
+            struct Options {
+                /**
+                 * Max # of concurrent connections. Zero means no limit.
+                 * Further connections are closed right after the handshake.
+                 */
+                size_t max_num_connections{0};
+
+                /**
+                 * Largest accepted message, in bytes. Messages are delivered
+                 * whole, however many frames they are sent in. A connection
+                 * sending a larger message is closed. Zero means no limit.
+                 */
+                size_t max_message_size{1024 * 1024};
+
+                /**
+                 * # of accepts kept pending, for connecting many clients at
+                 * once, f.i. when clients reconnect after a restart.
+                 */
+                size_t num_pending_accepts{4};
+
+                /**
+                 * Max # of messages queued to a connection, not counting
+                 * the one being sent. Zero means no limit.
+                 */
+                size_t max_queued_messages{0};
+
+                /**
+                 * Max # of bytes queued to a connection, not counting the
+                 * message being sent. A larger message is still queued to
+                 * an empty queue. Zero means no limit.
+                 */
+                size_t max_queued_bytes{0};
+
+                /** What to do when a queue limit is reached */
+                OverflowPolicy overflow_policy{OverflowPolicy::Block};
+
+                /** If set, counts the overflow policy actions taken */
+                std::shared_ptr<OverflowCounters> overflow_counters;
+
+                /**
+                 * Heartbeat interval, in ms. The heartbeat message is sent
+                 * to connections nothing has been sent to for that long,
+                 * f.i. for clients to answer, or to keep proxies from
+                 * timing out. Zero means no heartbeats.
+                 */
+                int heartbeat_interval_ms{0};
+
+                /**
+                 * Message sent as heartbeat. It arrives at the client as an
+                 * ordinary data message (text or binary, as the endpoint),
+                 * so clients must know to expect it. Empty means no
+                 * heartbeats.
+                 */
+                std::string heartbeat_message;
+
+                /**
+                 * Connections nothing has been received from for this long,
+                 * in ms, are closed. Zero means no timeout. Only messages
+                 * from the client count, so a client that only listens is
+                 * closed too, unless it answers heartbeats.
+                 */
+                int idle_timeout_ms{0};
+            };
         }  // namespace websocket
 
+        /**
+         * Options of a served directory
+         */
+        struct DirectoryOptions {
+            /**
+             * If true, served files are kept in memory, so repeated requests
+             * don't touch the filesystem. Files are expected not to change
+             * while the directory is served.
+             */
+            bool cache{false};
+
+            /**
+             * Max total size of cached files, in bytes. The least recently
+             * served files are evicted first.
+             */
+            size_t cache_size{64 * 1024 * 1024};
+
+            /**
+             * Cache-Control header of served files, f.i. "max-age=3600".
+             * Empty means none.
+             */
+            std::string cache_control;
+
+            /** Additional headers of served files */
+            std::map<std::string, std::string> headers;
+
+            /**
+             * If true, precompressed siblings of a file ("file.br",
+             * "file.gz") are served instead, to clients accepting that
+             * encoding
+             */
+            bool precompressed{true};
+        };
+
         class Server
         {
         public:
@@ -95,25 +421,90 @@ namespace siesta
              * @param method    HTTP method (GET, PUT etc.)
              * @param uri       Route URI
              * @param handler   Handler for route
+             * @param options   Route options
              * @returns A token. Hold on to returned token to keep route
              * "alive". When token goes out of scope, route is removed.
+             * Requests already dispatched to the handler are allowed to
+             * finish.
              */
             NO_DISCARD virtual std::unique_ptr<Token> addRoute(
                 HttpMethod method,
                 const std::string& uri,
-                rest::Handler handler) = 0;
+                rest::Handler handler,
+                const rest::RouteOptions& options = rest::RouteOptions()) = 0;
+
+            /**
+             * Adds an asynchronous REST route. The handler doesn't need to
+             * respond before returning, instead the response is sent when
+             * the completion passed to the handler is finished.
+             *
+             * @param method    HTTP method (GET, PUT etc.)
+             * @param uri       Route URI
+             * @param handler   Handler for route
+             * @param options   Route options
+             * @returns A token. Hold on to returned token to keep route
+             * "alive". When token goes out of scope, route is removed.
+             * Requests already dispatched to the handler are allowed to
+             * finish.
+             */
+            NO_DISCARD virtual std::unique_ptr<Token> addAsyncRoute(
+                HttpMethod method,
+                const std::string& uri,
+                rest::AsyncHandler handler,
+                const rest::RouteOptions& options = rest::RouteOptions()) = 0;
+
+            /**
+             * Adds a response that is the same for every request, f.i. a
+             * health check or a version. The response is serialized once,
+             * and sent straight from the network thread, without calling any
+             * handler or copying the body. Content-Length is set from the
+             * body.
+             *
+             * @param method    HTTP method (GET, PUT etc.)
+             * @param uri       Exact URI, without parameters
+             * @param status    Response status
+             * @param headers   Response headers, f.i. Content-Type
+             * @param body      Response body
+             * @returns A token. Hold on to returned token to keep response
+             * "alive". When token goes out of scope, response is removed.
+             */
+            NO_DISCARD virtual std::unique_ptr<Token> addStaticResponse(
+                HttpMethod method,
+                const std::string& uri,
+                HttpStatus status,
+                const std::map<std::string, std::string>& headers,
+                const std::string& body) = 0;
 
             /**
              * Adds serving of static folder.
              *
-             * @param uri   Directory URI
-             * @param path  Filesystem path of directory to server.
+             * @param uri       Directory URI
+             * @param path      Filesystem path of directory to server.
+             * @param options   Directory options
              * @returns A token. Hold on to returned token to keep directory
              * "alive". When token goes out of scope, directory is removed.
              */
             NO_DISCARD virtual std::unique_ptr<Token> addDirectory(
                 const std::string& uri,
-                const std::string& path) = 0;
+                const std::string& path,
+                const DirectoryOptions& options = DirectoryOptions()) = 0;
+
+            /**
+             * Adds serving of files embedded in the executable, generated by
+             * the siesta_embed_directory CMake function. Files are served
+             * straight from memory, without any filesystem access. The
+             * cache option doesn't apply.
+             *
+             * @param uri       Directory URI
+             * @param files     Embedded files, must outlive the directory
+             * @param options   Directory options
+             * @returns A token. Hold on to returned token to keep directory
+             * "alive". When token goes out of scope, directory is removed.
+             */
+            NO_DISCARD virtual std::unique_ptr<Token> addEmbeddedDirectory(
+                const std::string& uri,
+                const embedded::Directory& files,
+                const DirectoryOptions& options = DirectoryOptions()) = 0;
 
             /**
              * Adds websocket handler for text mode websocket.
@@ -130,6 +521,20 @@ namespace siesta
                 websocket::Factory factory,
                 const size_t max_num_connections = 0) = 0;
 
+            /**
+             * Adds websocket handler for text mode websocket.
+             *
+             * @param uri       Websocket URI
+             * @param factory   Factory for websocket handler.
+             * @param options   Websocket options
+             * @returns A token. Hold on to returned token to keep websocket
+             * "alive". When token goes out of scope, websocket is removed.
+             */
+            NO_DISCARD virtual std::unique_ptr<Token> addTextWebsocket(
+                const std::string& uri,
+                websocket::Factory factory,
+                const websocket::Options& options) = 0;
+
             /**
              * Adds websocket handler for binary mode websocket.
              *
@@ -145,6 +550,20 @@ namespace siesta
                 websocket::Factory factory,
                 const size_t max_num_connections = 0) = 0;
 
+            /**
+             * Adds websocket handler for binary mode websocket.
+             *
+             * @param uri       Websocket URI
+             * @param factory   Factory for websocket handler.
+             * @param options   Websocket options
+             * @returns A token. Hold on to returned token to keep websocket
+             * "alive". When token goes out of scope, websocket is removed.
+             */
+            NO_DISCARD virtual std::unique_ptr<Token> addBinaryWebsocket(
+                const std::string& uri,
+                websocket::Factory factory,
+                const websocket::Options& options) = 0;
+
             /**
              * Add a certificate. Used when TLS is enabled. Must be called
              * before server is started
@@ -173,18 +592,53 @@ namespace siesta
             virtual int port() const = 0;
         };
 
+        /**
+         * Server options
+         */
+        struct Options {
+            /**
+             * If true, callbacks are done on a worker thread, and not on the
+             * nng thread (which has limited stack size)
+             */
+            bool callback_on_worker_thread{true};
+
+            /** Number of worker threads. Zero means one per hardware thread */
+            size_t worker_threads{0};
+
+            /** Stack size of worker threads. Zero means platform default */
+            size_t worker_stack_size{8 * 1024 * 1024};
+
+            /**
+             * Max # of callbacks waiting for a worker thread. When full, REST
+             * requests are answered with "503 Service Unavailable", while
+             * websocket messages wait for room.
+             */
+            size_t worker_queue_size{1024};
+        };
+
         /**
          * Create a server instance
          *
          * @param address                   Address, f.i.
          * "http://127.0.0.1/9080"
-         * @param callback_on_new_thread    If true, callbacks are done on a new
-         * thread, and not on the nng thread (which has limited stack size)
+         * @param callback_on_new_thread    If true, callbacks are done on a
+         * worker thread, and not on the nng thread (which has limited stack
+         * size)
          * @returns A server instance
          */
         std::shared_ptr<Server> createServer(
             const std::string& address,
             const bool callback_on_new_thread = true);
 
+        /**
+         * Create a server instance
+         *
+         * @param address   Address, f.i. "http://127.0.0.1/9080"
+         * @param options   Server options
+         * @returns A server instance
+         */
+        std::shared_ptr<Server> createServer(const std::string& address,
+                                             const Options& options);
+
     }  // namespace server
 }  // namespace siesta
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "query.h"
+
+namespace siesta
+{
+    namespace detail
+    {
+        /**
+         * Incremental decoder of a body sent with chunked transfer encoding.
+         * Chunk extensions and trailers are skipped.
+         */
+        class ChunkDecoder
+        {
+        public:
+            /**
+             * Decode the next part of the encoded body, appending the decoded
+             * data to out.
+             *
+             * @returns The number of bytes consumed, which is less than len
+             * only when the end of the body has been reached
+             * @throws std::runtime_error on malformed input
+             */
+            size_t decode(const char* data, size_t len, std::string& out)
+            {
+                size_t i = 0;
+                while (i < len && state_ != State::Done) {
+                    if (state_ == State::Data) {
+                        size_t n = len - i;
+                        if (n > remaining_) {
+                            n = static_cast<size_t>(remaining_);
+                        }
+                        out.append(data + i, n);
+                        remaining_ -= n;
+                        i += n;
+                        if (remaining_ == 0) {
+                            state_ = State::DataEnd;
+                        }
+                        continue;
+                    }
+                    const char c = data[i++];
+                    switch (state_) {
+                        case State::Size: {
+                            const int v = hexValue(c);
+                            if (v >= 0) {
+                                if (remaining_ > (UINT64_MAX >> 4)) {
+                                    throw std::runtime_error(
+                                        "Chunk size too large");
+                                }
+                                remaining_ = (remaining_ << 4) | v;
+                                has_size_  = true;
+                            } else if (!has_size_) {
+                                throw std::runtime_error("Invalid chunk size");
+                            } else if (c == '\r') {
+                                state_ = State::SizeLF;
+                            } else if (c == '\n') {
+                                endOfSize();
+                            } else {
+                                state_ = State::Extension;
+                            }
+                            break;
+                        }
+                        case State::Extension:
+                            if (c == '\r') {
+                                state_ = State::SizeLF;
+                            } else if (c == '\n') {
+                                endOfSize();
+                            }
+                            break;
+                        case State::SizeLF:
+                            expectLF(c);
+                            endOfSize();
+                            break;
+                        case State::DataEnd:
+                            if (c != '\r') {
+                                throw std::runtime_error(
+                                    "Malformed chunked encoding");
+                            }
+                            state_ = State::DataEndLF;
+                            break;
+                        case State::DataEndLF:
+                            expectLF(c);
+                            state_ = State::Size;
+                            break;
+                        case State::Trailer:
+                            if (c == '\r') {
+                                state_ = State::TrailerLF;
+                            } else if (c == '\n') {
+                                endOfTrailerLine();
+                            } else {
+                                empty_line_ = false;
+                            }
+                            break;
+                        case State::TrailerLF:
+                            expectLF(c);
+                            endOfTrailerLine();
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                return i;
+            }
+
+            // True when the whole body has been decoded
+            bool done() const { return state_ == State::Done; }
+
+            // Number of bytes that can be read next without going past the
+            // end of the body, for readers that must not read beyond it. The
+            // shortest rest of the body is assumed, so a read can take the
+            // end of a chunk along with the size of the next one.
+            uint64_t wanted() const
+            {
+                // Shortest last chunk, with bare line feeds
+                const uint64_t last = 3;
+                switch (state_) {
+                    case State::Size:
+                        if (!has_size_) {
+                            return last;
+                        }
+                        // Fall through
+                    case State::Extension:
+                    case State::SizeLF:
+                        // End of line, then either the end of the body, or
+                        // the chunk data and the last chunk
+                        return remaining_ == 0
+                                   ? 2
+                                   : saturate(remaining_, 1 + 2 + last);
+                    case State::Data:
+                        return saturate(remaining_, 2 + last);
+                    case State::DataEnd:
+                        return 2 + last;
+                    case State::DataEndLF:
+                        return 1 + last;
+                    case State::Trailer:
+                    case State::TrailerLF:
+                        return empty_line_ ? 1 : 2;
+                    default:
+                        return 0;
+                }
+            }
+
+        private:
+            enum class State {
+                Size,
+                Extension,
+                SizeLF,
+                Data,
+                DataEnd,
+                DataEndLF,
+                Trailer,
+                TrailerLF,
+                Done
+            };
+
+            State state_{State::Size};
+            uint64_t remaining_{0};
+            bool has_size_{false};
+            bool empty_line_{true};
+
+            static uint64_t saturate(uint64_t a, uint64_t b)
+            {
+                return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+            }
+
+            static void expectLF(char c)
+            {
+                if (c != '\n') {
+                    throw std::runtime_error("Malformed chunked encoding");
+                }
+            }
+
+            void endOfSize()
+            {
+                state_      = remaining_ == 0 ? State::Trailer : State::Data;
+                has_size_   = false;
+                empty_line_ = true;
+            }
+
+            void endOfTrailerLine()
+            {
+                if (empty_line_) {
+                    state_ = State::Done;
+                } else {
+                    state_      = State::Trailer;
+                    empty_line_ = true;
+                }
+            }
+        };
+    }  // namespace detail
+}  // namespace siesta
@@ -7,6 +7,9 @@
 
 #include <vector>
 
+#include "chunked.h"
+#include "websocket.h"
+
 using namespace siesta;
 using namespace siesta::client;
 
@@ -25,6 +28,24 @@ namespace
         throw std::runtime_error(msg + ": " + std::string(nng_strerror(rv)));
     }
 
+    // Read a body sent with chunked transfer encoding
+    static void readChunked(nng_http_conn* conn, nng_aio* aio, std::string& r)
+    {
+        detail::ChunkDecoder decoder;
+        std::vector<char> buf(16 * 1024);
+        nng_iov iov;
+        iov.iov_buf = buf.data();
+        iov.iov_len = buf.size();
+        while (!decoder.done()) {
+            nng_aio_set_iov(aio, 1, &iov);
+            // Reads whatever is available
+            nng_http_conn_read(conn, aio);
+            nng_aio_wait(aio);
+            nng_call(nng_aio_result, aio);
+            decoder.decode(buf.data(), nng_aio_count(aio), r);
+        }
+    }
+
     Response doRequest(
         HttpMethod method,
         const std::vector<std::pair<std::string, std::string>> header,
@@ -112,16 +133,20 @@ namespace
             nng_call(nng_aio_result, aio);
 
             std::string r;
-            if (nng_http_res_get_status(res) != NNG_HTTP_STATUS_OK) {
-                throw siesta::Exception(
-                    static_cast<HttpStatus>(nng_http_res_get_status(res)),
-                    nng_http_res_get_reason(res));
+            const uint16_t status = nng_http_res_get_status(res);
+            if (status < 200 || status > 299) {
+                throw siesta::Exception(static_cast<HttpStatus>(status),
+                                        nng_http_res_get_reason(res));
             } else {
                 const char* hdr;
 
-                // This only supports regular transfer encoding (no
-                // Chunked-Encoding, and a Content-Length header is
-                // required.)
+                hdr = nng_http_res_get_header(res, "Transfer-Encoding");
+                if (hdr != NULL && strstr(hdr, "chunked") != NULL) {
+                    readChunked(conn, aio, r);
+                    return r;
+                }
+
+                // Otherwise, a Content-Length header is required
                 if ((hdr = nng_http_res_get_header(res, "Content-Length")) ==
                     NULL) {
                     throw std::runtime_error("Missing Content-Length header");
@@ -160,7 +185,6 @@ namespace
         nng_smart_ptr<nng_aio> aio_read{nng_aio_free};
         nng_smart_ptr<nng_aio> aio_write{nng_aio_free};
         nng_smart_ptr<nng_stream> stream{nng_stream_free};
-        std::vector<uint8_t> buffer;
         std::function<void(Writer&, const std::string&)> on_message;
         std::function<void(Writer&)> on_open;
         std::function<void(Writer&, const std::string&)> on_error;
@@ -175,7 +199,6 @@ namespace
             , on_open(open)
             , on_error(error)
             , on_close(close)
-            , buffer(32768)
         {
             int rv;
             nng_smart_ptr<nng_url> url{nng_url_free};
@@ -218,6 +241,8 @@ namespace
                     fatal("nng_stream_dialer_set_ptr", rv);
                 }
             }
+            // Whole messages, reassembled from their frames
+            nng_stream_dialer_set_bool(dialer, NNG_OPT_WS_MSGMODE, true);
             if (text_mode) {
                 nng_stream_dialer_set_bool(dialer, NNG_OPT_WS_RECV_TEXT, true);
                 nng_stream_dialer_set_bool(dialer, NNG_OPT_WS_SEND_TEXT, true);
@@ -245,12 +270,7 @@ namespace
             nng_stream_dialer_close(dialer);
         }
 
-        void startRead()
-        {
-            nng_iov iov{buffer.data(), buffer.size()};
-            nng_aio_set_iov(aio_read, 1, &iov);
-            nng_stream_recv(stream, aio_read);
-        }
+        void startRead() { nng_stream_recv(stream, aio_read); }
 
         void read_cb()
         {
@@ -267,8 +287,9 @@ namespace
                 }
                 return;
             }
-            auto len = nng_aio_count(aio_read);
-            std::string data((const char*)buffer.data(), len);
+            nng_msg* msg = siesta::detail::takeMessage(aio_read);
+            std::string data((const char*)nng_msg_body(msg), nng_msg_len(msg));
+            nng_msg_free(msg);
             if (on_message) {
                 on_message(*this, data);
             }
@@ -277,12 +298,16 @@ namespace
 
         void send(const std::string& data) override
         {
-            nng_iov iov{(void*)data.data(), data.size()};
-            nng_aio_set_iov(aio_write, 1, &iov);
+            int rv = siesta::detail::setMessage(
+                aio_write, data.data(), data.size());
+            if (rv != 0) {
+                fatal("nng_msg_alloc", rv);
+            }
             nng_stream_send(stream, aio_write);
             nng_aio_wait(aio_write);
-            int rv = nng_aio_result(aio_write);
+            rv = nng_aio_result(aio_write);
             if (rv != 0) {
+                nng_msg_free(siesta::detail::takeMessage(aio_write));
                 fatal("nng_aio_result", rv);
             }
         }
@@ -0,0 +1,469 @@
+#include "files.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef WIN32
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
+#endif
+
+using siesta::detail::FileCache;
+using siesta::detail::FileEntryPtr;
+
+namespace
+{
+    struct MimeType {
+        const char* extension;
+        const char* type;
+    };
+
+    // Sorted on extension
+    const MimeType mime_types[] = {
+        {"bmp", "image/bmp"},
+        {"css", "text/css"},
+        {"csv", "text/csv"},
+        {"gif", "image/gif"},
+        {"gz", "application/gzip"},
+        {"htm", "text/html"},
+        {"html", "text/html"},
+        {"ico", "image/x-icon"},
+        {"jpeg", "image/jpeg"},
+        {"jpg", "image/jpeg"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"map", "application/json"},
+        {"mjs", "application/javascript"},
+        {"mp3", "audio/mpeg"},
+        {"mp4", "video/mp4"},
+        {"otf", "font/otf"},
+        {"pdf", "application/pdf"},
+        {"png", "image/png"},
+        {"svg", "image/svg+xml"},
+        {"tar", "application/x-tar"},
+        {"ttf", "font/ttf"},
+        {"txt", "text/plain"},
+        {"wasm", "application/wasm"},
+        {"wav", "audio/wav"},
+        {"webm", "video/webm"},
+        {"webp", "image/webp"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"xml", "application/xml"},
+        {"zip", "application/zip"},
+    };
+
+    const char* const week_days[] = {
+        "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    const char* const months[] = {"Jan",
+                                  "Feb",
+                                  "Mar",
+                                  "Apr",
+                                  "May",
+                                  "Jun",
+                                  "Jul",
+                                  "Aug",
+                                  "Sep",
+                                  "Oct",
+                                  "Nov",
+                                  "Dec"};
+
+    // Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+    int64_t daysFromCivil(int64_t y, unsigned m, unsigned d)
+    {
+        y -= m <= 2;
+        const int64_t era  = (y >= 0 ? y : y - 399) / 400;
+        const unsigned yoe = static_cast<unsigned>(y - era * 400);
+        const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+        const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + static_cast<int64_t>(doe) - 719468;
+    }
+
+    // Inverse of daysFromCivil
+    void civilFromDays(int64_t z, int64_t& y, unsigned& m, unsigned& d)
+    {
+        z += 719468;
+        const int64_t era  = (z >= 0 ? z : z - 146096) / 146097;
+        const unsigned doe = static_cast<unsigned>(z - era * 146097);
+        const unsigned yoe =
+            (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        const unsigned mp  = (5 * doy + 2) / 153;
+        d                  = doy - (153 * mp + 2) / 5 + 1;
+        m                  = mp < 10 ? mp + 3 : mp - 9;
+        y                  = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+    }
+}  // namespace
+
+namespace siesta
+{
+    namespace detail
+    {
+        bool statFile(const std::string& path, FileStat& stat)
+        {
+#ifdef WIN32
+            struct _stat64 st;
+            if (_stat64(path.c_str(), &st) != 0) {
+                return false;
+            }
+            stat.directory = (st.st_mode & _S_IFDIR) != 0;
+#else
+            struct stat st;
+            if (::stat(path.c_str(), &st) != 0) {
+                return false;
+            }
+            stat.directory = S_ISDIR(st.st_mode);
+#endif
+            stat.size  = static_cast<uint64_t>(st.st_size);
+            stat.mtime = static_cast<int64_t>(st.st_mtime);
+            return true;
+        }
+
+        bool readFile(const std::string& path, std::string& data)
+        {
+            FileStat stat;
+            if (!statFile(path, stat) || stat.directory) {
+                return false;
+            }
+            std::FILE* f = std::fopen(path.c_str(), "rb");
+            if (f == nullptr) {
+                return false;
+            }
+            data.resize(static_cast<size_t>(stat.size));
+            const size_t n =
+                data.empty() ? 0 : std::fread(&data[0], 1, data.size(), f);
+            std::fclose(f);
+            // The file may have shrunk since stat
+            data.resize(n);
+            return true;
+        }
+
+        FileReader::FileReader(const std::string& path)
+            : file_(std::fopen(path.c_str(), "rb"))
+        {
+        }
+
+        FileReader::~FileReader()
+        {
+            if (file_ != nullptr) {
+                std::fclose(file_);
+            }
+        }
+
+        bool FileReader::read(uint64_t offset,
+                              uint64_t length,
+                              std::string& data)
+        {
+            if (file_ == nullptr) {
+                return false;
+            }
+#ifdef WIN32
+            const int rv =
+                _fseeki64(file_, static_cast<__int64>(offset), SEEK_SET);
+#else
+            const int rv = fseeko(file_, static_cast<off_t>(offset), SEEK_SET);
+#endif
+            const size_t start = data.size();
+            size_t n           = 0;
+            if (rv == 0) {
+                data.resize(start + static_cast<size_t>(length));
+                n = length == 0 ? 0
+                                : std::fread(&data[start],
+                                             1,
+                                             static_cast<size_t>(length),
+                                             file_);
+            }
+            data.resize(start + n);
+            return rv == 0 && n == length;
+        }
+
+        bool acceptsEncoding(const char* header, const char* coding)
+        {
+            const size_t len = strlen(coding);
+            const char* p    = header;
+            bool star        = false;
+            while (*p != '\0') {
+                while (*p == ' ' || *p == '\t' || *p == ',') {
+                    ++p;
+                }
+                const char* name = p;
+                while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' &&
+                       *p != '\t') {
+                    ++p;
+                }
+                const size_t name_len = p - name;
+                const bool match =
+                    name_len == len && strncasecmp(name, coding, len) == 0;
+                const bool wildcard = name_len == 1 && name[0] == '*';
+                // Parameters, of which only q matters
+                double q = 1;
+                while (*p != '\0' && *p != ',') {
+                    if (*p == ';') {
+                        ++p;
+                        while (*p == ' ' || *p == '\t') {
+                            ++p;
+                        }
+                        if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                            q = atof(p + 2);
+                        }
+                    } else {
+                        ++p;
+                    }
+                }
+                if (match) {
+                    return q > 0;
+                }
+                if (wildcard) {
+                    // Unless the coding is listed explicitly
+                    star = q > 0;
+                }
+            }
+            return star;
+        }
+
+        RangeResult parseRanges(const char* header,
+                                uint64_t size,
+                                size_t max_ranges,
+                                std::vector<ByteRange>& ranges)
+        {
+            ranges.clear();
+            if (strncmp(header, "bytes=", 6) != 0) {
+                return RangeResult::Ignore;
+            }
+            // Parse a number, returning false if there is none
+            auto number = [](const char*& p, uint64_t& value) {
+                if (*p < '0' || *p > '9') {
+                    return false;
+                }
+                value = 0;
+                for (; *p >= '0' && *p <= '9'; ++p) {
+                    if (value > (UINT64_MAX - 9) / 10) {
+                        return false;
+                    }
+                    value = value * 10 + (*p - '0');
+                }
+                return true;
+            };
+            size_t count  = 0;
+            const char* p = header + 6;
+            for (;;) {
+                while (*p == ' ' || *p == '\t') {
+                    ++p;
+                }
+                uint64_t first = 0, last = UINT64_MAX;
+                if (*p == '-') {
+                    // Suffix range, the last bytes of the file
+                    uint64_t suffix;
+                    if (!number(++p, suffix)) {
+                        return RangeResult::Ignore;
+                    }
+                    first = suffix == 0 ? size : size - std::min(suffix, size);
+                } else if (!number(p, first) || *p++ != '-') {
+                    return RangeResult::Ignore;
+                } else if (*p >= '0' && *p <= '9') {
+                    if (!number(p, last) || last < first) {
+                        return RangeResult::Ignore;
+                    }
+                }
+                if (++count > max_ranges) {
+                    return RangeResult::Ignore;
+                }
+                if (first < size) {
+                    ranges.push_back(
+                        ByteRange{first, std::min(last, size - 1)});
+                }
+                while (*p == ' ' || *p == '\t') {
+                    ++p;
+                }
+                if (*p == '\0') {
+                    break;
+                }
+                if (*p++ != ',') {
+                    return RangeResult::Ignore;
+                }
+            }
+            if (ranges.empty()) {
+                return RangeResult::Unsatisfiable;
+            }
+            // Coalesce overlapping and adjacent ranges, so that the parts
+            // never add up to more than the file
+            std::sort(ranges.begin(),
+                      ranges.end(),
+                      [](const ByteRange& a, const ByteRange& b) {
+                          return a.first < b.first;
+                      });
+            size_t merged = 0;
+            for (size_t i = 1; i < ranges.size(); ++i) {
+                if (ranges[i].first <= ranges[merged].last + 1) {
+                    ranges[merged].last =
+                        std::max(ranges[merged].last, ranges[i].last);
+                } else {
+                    ranges[++merged] = ranges[i];
+                }
+            }
+            ranges.resize(merged + 1);
+            return RangeResult::Satisfiable;
+        }
+
+        const char* mimeType(const std::string& path)
+        {
+            const auto dot   = path.rfind('.');
+            const auto slash = path.rfind('/');
+            if (dot != std::string::npos &&
+                (slash == std::string::npos || dot > slash)) {
+                std::string ext = path.substr(dot + 1);
+                for (auto& c : ext) {
+                    if (c >= 'A' && c <= 'Z') {
+                        c = c - 'A' + 'a';
+                    }
+                }
+                size_t lo = 0;
+                size_t hi = sizeof(mime_types) / sizeof(mime_types[0]);
+                while (lo < hi) {
+                    const size_t mid = (lo + hi) / 2;
+                    const int c =
+                        strcmp(mime_types[mid].extension, ext.c_str());
+                    if (c == 0) {
+                        return mime_types[mid].type;
+                    }
+                    if (c < 0) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+            }
+            return "application/octet-stream";
+        }
+
+        std::string httpDate(int64_t time)
+        {
+            int64_t days = time / 86400;
+            int64_t secs = time % 86400;
+            if (secs < 0) {
+                secs += 86400;
+                --days;
+            }
+            int64_t y;
+            unsigned m, d;
+            civilFromDays(days, y, m, d);
+            const int64_t wday = ((days % 7) + 11) % 7;  // 1970-01-01 is Thu
+            char buf[64];
+            snprintf(buf,
+                     sizeof(buf),
+                     "%s, %02u %s %04lld %02d:%02d:%02d GMT",
+                     week_days[wday],
+                     d,
+                     months[m - 1],
+                     (long long)y,
+                     (int)(secs / 3600),
+                     (int)(secs / 60 % 60),
+                     (int)(secs % 60));
+            return buf;
+        }
+
+        bool parseHttpDate(const char* s, int64_t& time)
+        {
+            char wday[4], month[4];
+            unsigned d, h, mi, sec;
+            int y;
+            if (sscanf(s,
+                       "%3s, %u %3s %d %u:%u:%u GMT",
+                       wday,
+                       &d,
+                       month,
+                       &y,
+                       &h,
+                       &mi,
+                       &sec) != 7) {
+                return false;
+            }
+            for (unsigned m = 0; m < 12; ++m) {
+                if (strcmp(months[m], month) == 0) {
+                    if (d < 1 || d > 31 || h > 23 || mi > 59 || sec > 60) {
+                        return false;
+                    }
+                    time = daysFromCivil(y, m + 1, d) * 86400 + h * 3600 +
+                           mi * 60 + sec;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void describeFile(FileEntry& entry)
+        {
+            entry.mime_type = mimeType(entry.path);
+            char etag[48];
+            snprintf(etag,
+                     sizeof(etag),
+                     "\"%llx-%llx\"",
+                     (unsigned long long)entry.stat.mtime,
+                     (unsigned long long)entry.stat.size);
+            entry.etag          = etag;
+            entry.last_modified = httpDate(entry.stat.mtime);
+        }
+    }  // namespace detail
+}  // namespace siesta
+
+size_t siesta::detail::FileEntry::dataSize() const
+{
+    size_t size = data ? data->size() : 0;
+    if (brotli) {
+        size += brotli->dataSize();
+    }
+    if (gzip) {
+        size += gzip->dataSize();
+    }
+    return size;
+}
+
+FileEntryPtr FileCache::get(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return it->second.entry;
+}
+
+void FileCache::put(const std::string& key, FileEntryPtr entry)
+{
+    const size_t size = entry->dataSize();
+    if (size > max_size_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        size_ -= it->second.entry->dataSize();
+        lru_.erase(it->second.lru);
+        entries_.erase(it);
+    }
+    while (size_ + size > max_size_ && !lru_.empty()) {
+        auto victim = entries_.find(lru_.back());
+        size_ -= victim->second.entry->dataSize();
+        entries_.erase(victim);
+        lru_.pop_back();
+    }
+    lru_.push_front(key);
+    Slot slot;
+    slot.entry = std::move(entry);
+    slot.lru   = lru_.begin();
+    entries_.emplace(key, std::move(slot));
+    size_ += size;
+}
+
+size_t FileCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
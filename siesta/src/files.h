@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace siesta
+{
+    namespace detail
+    {
+        struct FileStat {
+            uint64_t size{0};
+            // Modification time, in seconds since the epoch
+            int64_t mtime{0};
+            bool directory{false};
+        };
+
+        // Get size, modification time and type of a file. Returns false if
+        // there is no such file.
+        bool statFile(const std::string& path, FileStat& stat);
+
+        // Read a whole file. Returns false if the file can't be read.
+        bool readFile(const std::string& path, std::string& data);
+
+        // Reads parts of a file, keeping it open in between
+        class FileReader
+        {
+        public:
+            explicit FileReader(const std::string& path);
+            ~FileReader();
+            FileReader(const FileReader&) = delete;
+            FileReader& operator=(const FileReader&) = delete;
+
+            bool isOpen() const { return file_ != nullptr; }
+
+            // Read part of the file, appending it to data. Returns false if
+            // the part can't be read.
+            bool read(uint64_t offset, uint64_t length, std::string& data);
+
+        private:
+            std::FILE* file_;
+        };
+
+        // MIME type of a file, from its extension
+        const char* mimeType(const std::string& path);
+
+        // Format a time, in seconds since the epoch, as an HTTP date
+        std::string httpDate(int64_t time);
+
+        // Parse an HTTP date (IMF-fixdate only). Returns false if malformed.
+        bool parseHttpDate(const char* s, int64_t& time);
+
+        /**
+         * True if an Accept-Encoding header accepts a content coding (f.i.
+         * "gzip"), explicitly or through "*".
+         */
+        bool acceptsEncoding(const char* header, const char* coding);
+
+        // Byte range of a file, last byte included
+        struct ByteRange {
+            uint64_t first;
+            uint64_t last;
+            uint64_t length() const { return last - first + 1; }
+        };
+
+        enum class RangeResult {
+            // Malformed (or too many ranges), to be ignored
+            Ignore,
+            Satisfiable,
+            Unsatisfiable
+        };
+
+        /**
+         * Parse a Range header ("bytes=0-99,200-,-50"), for a file of the
+         * given size. Ranges outside of the file are dropped, and the others
+         * are sorted, with overlapping and adjacent ranges coalesced.
+         */
+        RangeResult parseRanges(const char* header,
+                                uint64_t size,
+                                size_t max_ranges,
+                                std::vector<ByteRange>& ranges);
+
+        /**
+         * A file to be served, with everything needed for the response
+         * worked out up front.
+         */
+        struct FileEntry {
+            std::string path;
+            FileStat stat;
+            std::string mime_type;
+            std::string etag;
+            std::string last_modified;
+            // Content coding of a precompressed variant, empty if none
+            std::string encoding;
+            // True if the file has precompressed variants
+            bool vary{false};
+            // Content, if in memory. Points into data when loaded from a
+            // file, or to static data when embedded.
+            const char* content{nullptr};
+            size_t content_size{0};
+            // Content loaded from a file
+            std::shared_ptr<const std::string> data;
+            // Precompressed variants, if any
+            std::shared_ptr<const FileEntry> brotli;
+            std::shared_ptr<const FileEntry> gzip;
+
+            bool inMemory() const { return content != nullptr; }
+
+            // Set content loaded from a file
+            void setData(std::shared_ptr<const std::string> loaded)
+            {
+                data         = std::move(loaded);
+                content      = data ? data->data() : nullptr;
+                content_size = data ? data->size() : 0;
+            }
+
+            // Size of the loaded content, including variants
+            size_t dataSize() const;
+        };
+        using FileEntryPtr = std::shared_ptr<const FileEntry>;
+
+        // Set MIME type, ETag and Last-Modified of an entry, from its path
+        // and stat
+        void describeFile(FileEntry& entry);
+
+        /**
+         * In-memory cache of served files, with least recently used entries
+         * evicted when the total size exceeds the limit. Files are expected
+         * not to change while cached.
+         */
+        class FileCache
+        {
+        public:
+            explicit FileCache(size_t max_size) : max_size_(max_size) {}
+
+            size_t maxSize() const { return max_size_; }
+
+            // Get a cached entry, or nullptr
+            FileEntryPtr get(const std::string& key);
+
+            // Add an entry with loaded data. Entries larger than the cache
+            // are not added.
+            void put(const std::string& key, FileEntryPtr entry);
+
+            // Total size of cached data
+            size_t size() const;
+
+        private:
+            using Lru = std::list<std::string>;
+            struct Slot {
+                FileEntryPtr entry;
+                Lru::iterator lru;
+            };
+
+            const size_t max_size_;
+            mutable std::mutex mutex_;
+            std::unordered_map<std::string, Slot> entries_;
+            // Most recently used first
+            Lru lru_;
+            size_t size_{0};
+        };
+    }  // namespace detail
+}  // namespace siesta
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+
+namespace siesta
+{
+    namespace detail
+    {
+        /**
+         * A deque only allocated once something is added. An empty
+         * std::deque allocates its first block on construction (libstdc++),
+         * which adds up for per-connection queues that mostly stay empty,
+         * while a list allocates for every item queued. Once allocated, the
+         * deque is kept, to be reused by the next items.
+         */
+        template <class T>
+        class LazyDeque
+        {
+        public:
+            using iterator = typename std::deque<T>::iterator;
+
+            bool empty() const { return !items_ || items_->empty(); }
+            size_t size() const { return items_ ? items_->size() : 0; }
+
+            T& front() { return items_->front(); }
+            T& back() { return items_->back(); }
+
+            iterator begin() { return items_ ? items_->begin() : iterator(); }
+            iterator end() { return items_ ? items_->end() : iterator(); }
+
+            void push_back(T item)
+            {
+                if (!items_) {
+                    items_.reset(new std::deque<T>);
+                }
+                items_->push_back(std::move(item));
+            }
+
+            void pop_front() { items_->pop_front(); }
+
+            void clear()
+            {
+                if (items_) {
+                    items_->clear();
+                }
+            }
+
+        private:
+            std::unique_ptr<std::deque<T>> items_;
+        };
+    }  // namespace detail
+}  // namespace siesta
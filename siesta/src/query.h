@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+namespace siesta
+{
+    namespace detail
+    {
+        inline int hexValue(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        }
+
+        /**
+         * Decode a percent encoded string into out. If plus_is_space, '+' is
+         * decoded as a space. Malformed escapes are kept as is.
+         */
+        inline void decodePercent(const char* s,
+                                  size_t len,
+                                  std::string& out,
+                                  bool plus_is_space)
+        {
+            out.clear();
+            out.reserve(len);
+            const char* end = s + len;
+            while (s < end) {
+                // Copy runs of plain characters in one go
+                const char* p = s;
+                while (p < end && *p != '%' && (*p != '+' || !plus_is_space)) {
+                    ++p;
+                }
+                out.append(s, p - s);
+                if (p == end) {
+                    break;
+                }
+                if (*p == '+') {
+                    out += ' ';
+                    s = p + 1;
+                    continue;
+                }
+                int hi, lo;
+                if (end - p > 2 && (hi = hexValue(p[1])) >= 0 &&
+                    (lo = hexValue(p[2])) >= 0) {
+                    out += static_cast<char>((hi << 4) | lo);
+                    s = p + 3;
+                } else {
+                    out += '%';
+                    s = p + 1;
+                }
+            }
+        }
+
+        /**
+         * Decode a percent encoded query component into out. '+' is decoded
+         * as a space. Malformed escapes are kept as is.
+         */
+        inline void decodeQueryComponent(const char* s,
+                                         size_t len,
+                                         std::string& out)
+        {
+            decodePercent(s, len, out, true);
+        }
+
+        /**
+         * Split a query string (the part after '?') into key/value pairs,
+         * without allocating.
+         *
+         * For each pair with a non-empty key,
+         * fn(key, key_len, value, value_len) is called, with pointers into
+         * the query string. Keys without '=' get an empty value.
+         */
+        template <class Fn>
+        void forEachQuery(const char* s, size_t len, Fn fn)
+        {
+            const char* end = s + len;
+            while (s < end) {
+                auto amp = static_cast<const char*>(memchr(s, '&', end - s));
+                const char* pair_end = amp != nullptr ? amp : end;
+                auto eq =
+                    static_cast<const char*>(memchr(s, '=', pair_end - s));
+                const char* key_end = eq != nullptr ? eq : pair_end;
+                if (key_end != s) {
+                    const char* value = eq != nullptr ? eq + 1 : pair_end;
+                    fn(s, key_end - s, value, pair_end - value);
+                }
+                if (amp == nullptr) {
+                    break;
+                }
+                s = amp + 1;
+            }
+        }
+    }  // namespace detail
+}  // namespace siesta
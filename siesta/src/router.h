@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace siesta
+{
+    namespace detail
+    {
+        // A matched route parameter, pointing into the matched path
+        using Capture  = std::pair<const char*, size_t>;
+        using Captures = std::vector<Capture>;
+
+        /**
+         * Segment based route trie.
+         *
+         * Each edge of the trie is one path segment, which is either a
+         * literal, a parameter (":name", matching one non-empty segment) or a
+         * wildcard ("*" or "*name", matching the remainder of the path). A
+         * wildcard must be the last segment of a route. When matching,
+         * literals take precedence over parameters, which take precedence
+         * over wildcards.
+         *
+         * Several values may be stored for the same route, keyed by id. The
+         * value with the lowest id wins.
+         */
+        template <class Value>
+        class Router
+        {
+        public:
+            /**
+             * Get the parameter names of a route, in the order they appear.
+             * An unnamed wildcard is named "*".
+             */
+            static std::vector<std::string> parameterNames(
+                const std::string& route)
+            {
+                std::vector<std::string> names;
+                forEachSegment(route, [&](const char* s, size_t len, bool) {
+                    if (len > 0 && s[0] == ':') {
+                        names.emplace_back(s + 1, len - 1);
+                    } else if (len > 0 && s[0] == '*') {
+                        names.emplace_back(len > 1 ? std::string(s + 1, len - 1)
+                                                   : std::string("*"));
+                    }
+                });
+                return names;
+            }
+
+            void insert(const std::string& route, int id, Value value)
+            {
+                Node* node = &root_;
+                forEachSegment(route, [&](const char* s,
+                                          size_t len,
+                                          bool last) {
+                    if (len > 0 && s[0] == ':') {
+                        if (len == 1) {
+                            throw std::invalid_argument(
+                                "Unnamed route parameter in '" + route + "'");
+                        }
+                        if (!node->param) {
+                            node->param.reset(new Node);
+                        }
+                        node = node->param.get();
+                    } else if (len > 0 && s[0] == '*') {
+                        if (!last) {
+                            throw std::invalid_argument(
+                                "Wildcard must be last segment in '" + route +
+                                "'");
+                        }
+                        if (!node->wildcard) {
+                            node->wildcard.reset(new Node);
+                        }
+                        node = node->wildcard.get();
+                    } else {
+                        auto it = findLiteral(*node, s, len);
+                        if (it == node->literals.end() ||
+                            !equals(it->first, s, len)) {
+                            it = node->literals.emplace(
+                                it,
+                                std::string(s, len),
+                                std::unique_ptr<Node>(new Node));
+                        }
+                        node = it->second.get();
+                    }
+                });
+                node->values.erase(id);
+                node->values.emplace(id, std::move(value));
+            }
+
+            bool erase(const std::string& route, int id)
+            {
+                std::vector<std::string> segments;
+                forEachSegment(route, [&](const char* s, size_t len, bool) {
+                    segments.emplace_back(s, len);
+                });
+                return erase(root_, segments, 0, id);
+            }
+
+            bool empty() const { return root_.empty(); }
+
+            /**
+             * Match a path (without query) against the stored routes.
+             *
+             * @param path      Path to match
+             * @param len       Length of path
+             * @param captures  Receives the parameter values, in the same
+             * order as parameterNames() of the matched route. The captures
+             * point into path.
+             * @returns The matched value, or nullptr
+             */
+            const Value* match(const char* path,
+                               size_t len,
+                               Captures& captures) const
+            {
+                captures.clear();
+                return find(root_, path, path + len, captures);
+            }
+
+        private:
+            struct Node {
+                // Sorted on segment, to allow binary search
+                std::vector<std::pair<std::string, std::unique_ptr<Node>>>
+                    literals;
+                std::unique_ptr<Node> param;
+                std::unique_ptr<Node> wildcard;
+                std::map<int, Value> values;
+
+                bool empty() const
+                {
+                    return literals.empty() && !param && !wildcard &&
+                           values.empty();
+                }
+            };
+            using Literals = decltype(Node::literals);
+
+            Node root_;
+
+            template <class Fn>
+            static void forEachSegment(const std::string& route, Fn fn)
+            {
+                const char* p   = route.c_str();
+                const char* end = p + route.size();
+                for (;;) {
+                    const char* seg_end = std::find(p, end, '/');
+                    fn(p, seg_end - p, seg_end == end);
+                    if (seg_end == end) {
+                        break;
+                    }
+                    p = seg_end + 1;
+                }
+            }
+
+            static bool equals(const std::string& a, const char* b, size_t len)
+            {
+                return a.size() == len && memcmp(a.data(), b, len) == 0;
+            }
+
+            static typename Literals::const_iterator findLiteral(
+                const Node& node,
+                const char* s,
+                size_t len)
+            {
+                return std::lower_bound(
+                    node.literals.begin(),
+                    node.literals.end(),
+                    std::make_pair(s, len),
+                    [](const typename Literals::value_type& a,
+                       const std::pair<const char*, size_t>& b) {
+                        const int c =
+                            memcmp(a.first.data(),
+                                   b.first,
+                                   std::min(a.first.size(), b.second));
+                        return c < 0 || (c == 0 && a.first.size() < b.second);
+                    });
+            }
+
+            static typename Literals::iterator findLiteral(Node& node,
+                                                           const char* s,
+                                                           size_t len)
+            {
+                auto it = findLiteral(static_cast<const Node&>(node), s, len);
+                return node.literals.begin() +
+                       (it - node.literals.cbegin());
+            }
+
+            // 'seg' points at the start of the current segment, or is
+            // nullptr when the whole path has been consumed.
+            static const Value* find(const Node& node,
+                                     const char* seg,
+                                     const char* end,
+                                     Captures& captures)
+            {
+                if (seg == nullptr) {
+                    return node.values.empty() ? nullptr
+                                               : &node.values.begin()->second;
+                }
+                const char* seg_end = std::find(seg, end, '/');
+                const char* next    = (seg_end == end) ? nullptr : seg_end + 1;
+                const size_t len    = seg_end - seg;
+
+                auto it = findLiteral(node, seg, len);
+                if (it != node.literals.end() && equals(it->first, seg, len)) {
+                    if (auto v = find(*it->second, next, end, captures)) {
+                        return v;
+                    }
+                }
+                if (node.param && len > 0) {
+                    captures.emplace_back(seg, len);
+                    if (auto v = find(*node.param, next, end, captures)) {
+                        return v;
+                    }
+                    captures.pop_back();
+                }
+                if (node.wildcard && !node.wildcard->values.empty()) {
+                    captures.emplace_back(seg, end - seg);
+                    return &node.wildcard->values.begin()->second;
+                }
+                return nullptr;
+            }
+
+            static bool erase(Node& node,
+                              const std::vector<std::string>& segments,
+                              size_t index,
+                              int id)
+            {
+                if (index == segments.size()) {
+                    return node.values.erase(id) > 0;
+                }
+                const auto& s = segments[index];
+                bool erased   = false;
+                if (!s.empty() && s[0] == ':') {
+                    if (node.param) {
+                        erased = erase(*node.param, segments, index + 1, id);
+                        if (node.param->empty()) {
+                            node.param.reset();
+                        }
+                    }
+                } else if (!s.empty() && s[0] == '*') {
+                    if (node.wildcard) {
+                        erased = erase(*node.wildcard, segments, index + 1, id);
+                        if (node.wildcard->empty()) {
+                            node.wildcard.reset();
+                        }
+                    }
+                } else {
+                    auto it = findLiteral(node, s.data(), s.size());
+                    if (it != node.literals.end() && it->first == s) {
+                        erased = erase(*it->second, segments, index + 1, id);
+                        if (it->second->empty()) {
+                            node.literals.erase(it);
+                        }
+                    }
+                }
+                return erased;
+            }
+        };
+    }  // namespace detail
+}  // namespace siesta
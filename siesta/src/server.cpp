@@ -7,11 +7,25 @@
 #include <nng/transport/tls/tls.h>
 #include <siesta/server.h>
 
+#include "chunked.h"
+#include "files.h"
+#include "lazy_deque.h"
+#include "query.h"
+#include "router.h"
+#include "thread_pool.h"
+#include "timing_wheel.h"
+#include "websocket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
-#include <future>
+#include <deque>
 #include <iostream>
+#include <limits>
 #include <mutex>
-#include <regex>
 #include <sstream>
 #include <stdexcept>
 
@@ -111,18 +125,221 @@ zFX5yAtcD5BnoPBo0CE5y/I=
         throw std::runtime_error(ss.str());
     }
 
+    // Reads a request body from its connection, in parts, never reading past
+    // the end of the body (the next request may follow on the connection)
+    class BodyReader
+    {
+        bool chunked_{false};
+        // Left to read, if not chunked
+        uint64_t remaining_{0};
+        detail::ChunkDecoder decoder_;
+        uint64_t size_{0};
+        const uint64_t max_size_;
+        std::vector<char> buf_;
+
+    public:
+        /**
+         * @throws siesta::Exception if the body is too large, or its length
+         * is malformed
+         */
+        BodyReader(nng_http_req* req, size_t max_size) : max_size_(max_size)
+        {
+            const char* hdr = nng_http_req_get_header(req, "Transfer-Encoding");
+            if (hdr != nullptr && strstr(hdr, "chunked") != nullptr) {
+                chunked_ = true;
+                return;
+            }
+            hdr = nng_http_req_get_header(req, "Content-Length");
+            if (hdr == nullptr) {
+                return;
+            }
+            for (const char* p = hdr; *p != '\0'; ++p) {
+                if (*p < '0' || *p > '9' || remaining_ > UINT64_MAX / 10) {
+                    throw siesta::Exception(HttpStatus::BAD_REQUEST,
+                                            "Invalid Content-Length");
+                }
+                remaining_ = remaining_ * 10 + (*p - '0');
+            }
+            if (remaining_ > max_size_) {
+                throw siesta::Exception(HttpStatus::PAYLOAD_TOO_LARGE);
+            }
+        }
+
+        bool done() const
+        {
+            return chunked_ ? decoder_.done() : remaining_ == 0;
+        }
+
+        // Length of the body, if known up front
+        uint64_t contentLength() const { return chunked_ ? 0 : remaining_; }
+
+        // Start reading the next part, of at most max_size bytes
+        void read(nng_http_conn* conn, nng_aio* aio, size_t max_size)
+        {
+            uint64_t n = chunked_ ? decoder_.wanted() : remaining_;
+            n          = std::min<uint64_t>(n, max_size);
+            n          = std::min<uint64_t>(n, 64 * 1024);
+            if (buf_.size() < n) {
+                buf_.resize(static_cast<size_t>(n));
+            }
+            nng_iov iov;
+            iov.iov_buf = buf_.data();
+            iov.iov_len = static_cast<size_t>(n);
+            nng_aio_set_iov(aio, 1, &iov);
+            nng_http_conn_read(conn, aio);
+        }
+
+        /**
+         * Handle a completed read, appending the read body data to out.
+         *
+         * @throws siesta::Exception if the body is too large, or malformed
+         */
+        void complete(nng_aio* aio, std::string& out)
+        {
+            const size_t count = nng_aio_count(aio);
+            const size_t before = out.size();
+            if (chunked_) {
+                try {
+                    decoder_.decode(buf_.data(), count, out);
+                } catch (std::runtime_error& e) {
+                    throw siesta::Exception(HttpStatus::BAD_REQUEST, e.what());
+                }
+            } else {
+                out.append(buf_.data(), count);
+                remaining_ -= count;
+            }
+            size_ += out.size() - before;
+            if (size_ > max_size_) {
+                throw siesta::Exception(HttpStatus::PAYLOAD_TOO_LARGE);
+            }
+        }
+    };
+
     class RequestImpl : public rest::Request
     {
         nng_http_req* req_;
-        const std::string my_uri_;
+        // Points into the nng request
+        const string_view uri_;
+        const string_view path_;
+        string_view body_;
+
+        // Names of the URI parameters of the matched route, and their
+        // values (pointing into uri_)
+        const std::vector<std::string>* param_names_{nullptr};
+        detail::Captures params_;
+
+        // Copies, created on first use
+        mutable std::once_flag uri_copied_;
+        mutable std::string uri_copy_;
+        mutable std::once_flag params_copied_;
+        mutable std::map<std::string, std::string> uri_parameters_;
+        mutable std::once_flag queries_parsed_;
+        mutable std::map<std::string, std::string> queries_;
+        mutable QueryList query_list_;
+
+        // Body collected by siesta
+        std::string body_storage_;
+        mutable size_t body_read_{0};
+        // Reader of a body left on the connection
+        std::unique_ptr<BodyReader> body_reader_;
+        nng_http_conn* conn_{nullptr};
+        mutable nng_aio* read_aio_{nullptr};
+        mutable std::string read_buf_;
+
+        static string_view pathOf(string_view uri)
+        {
+            auto q = static_cast<const char*>(
+                memchr(uri.data(), '?', uri.size()));
+            return string_view(uri.data(),
+                               q != nullptr ? q - uri.data() : uri.size());
+        }
+
+        void parseQueries() const
+        {
+            std::call_once(queries_parsed_, [this] {
+                if (path_.size() == uri_.size()) {
+                    return;
+                }
+                detail::forEachQuery(
+                    path_.end() + 1,
+                    uri_.size() - path_.size() - 1,
+                    [this](const char* key,
+                           size_t key_len,
+                           const char* value,
+                           size_t value_len) {
+                        query_list_.emplace_back();
+                        auto& entry = query_list_.back();
+                        detail::decodeQueryComponent(key, key_len, entry.first);
+                        detail::decodeQueryComponent(
+                            value, value_len, entry.second);
+                    });
+                for (const auto& entry : query_list_) {
+                    queries_.insert(entry);
+                }
+            });
+        }
 
     public:
         RequestImpl(nng_http_req* req)
-            : req_(req), my_uri_(nng_http_req_get_uri(req))
+            : req_(req)
+            , uri_(nng_http_req_get_uri(req))
+            , path_(pathOf(uri_))
+        {
+            void* data = nullptr;
+            size_t sz  = 0ULL;
+            nng_http_req_get_data(req, &data, &sz);
+            if (data != nullptr) {
+                body_ = string_view((const char*)data, sz);
+            }
+        }
+
+        ~RequestImpl()
         {
+            if (read_aio_ != nullptr) {
+                nng_aio_free(read_aio_);
+            }
+        }
+
+        // Set a body collected from the connection
+        void setBody(std::string body)
+        {
+            body_storage_ = std::move(body);
+            body_         = string_view(body_storage_);
+        }
+
+        // Leave the body on the connection, for the handler to read
+        void streamBody(nng_http_conn* conn, std::unique_ptr<BodyReader> reader)
+        {
+            conn_        = conn;
+            body_reader_ = std::move(reader);
         }
 
-        const std::string& getUri() const override { return my_uri_; }
+        // False if part of the body is left unread on the connection
+        bool bodyConsumed() const
+        {
+            return !body_reader_ || body_reader_->done();
+        }
+
+        // The URI without query, of an nng request
+        static string_view path(nng_http_req* req)
+        {
+            return pathOf(nng_http_req_get_uri(req));
+        }
+
+        // Set URI parameters of matched route. The names must outlive
+        // the request.
+        void setUriParameters(const std::vector<std::string>& names,
+                              detail::Captures values)
+        {
+            param_names_ = &names;
+            params_      = std::move(values);
+        }
+
+        const std::string& getUri() const override
+        {
+            std::call_once(uri_copied_, [this] { uri_copy_ = uri_.str(); });
+            return uri_copy_;
+        }
 
         const HttpMethod getMethod() const override
         {
@@ -133,30 +350,83 @@ zFX5yAtcD5BnoPBo0CE5y/I=
         const std::map<std::string, std::string>& getUriParameters()
             const override
         {
+            std::call_once(params_copied_, [this] {
+                for (size_t i = 0; i < params_.size(); ++i) {
+                    uri_parameters_.insert(std::make_pair(
+                        (*param_names_)[i],
+                        std::string(params_[i].first, params_[i].second)));
+                }
+            });
             return uri_parameters_;
         }
 
         const std::map<std::string, std::string>& getQueries() const override
         {
+            parseQueries();
             return queries_;
         }
 
+        const QueryList& getQueryList() const override
+        {
+            parseQueries();
+            return query_list_;
+        }
+
         std::string getHeader(const std::string& key) const override
         {
-            std::string retval;
-            auto header = nng_http_req_get_header(req_, key.c_str());
-            if (header != NULL) {
-                retval = header;
+            return getHeaderView(key.c_str()).str();
+        }
+
+        std::string getBody() const override { return body_.str(); }
+
+        size_t readBody(void* buf, size_t size) const override
+        {
+            if (!body_reader_) {
+                const size_t n = std::min(size, body_.size() - body_read_);
+                memcpy(buf, body_.data() + body_read_, n);
+                body_read_ += n;
+                return n;
+            }
+            int rv;
+            if (read_aio_ == nullptr &&
+                (rv = nng_aio_alloc(&read_aio_, NULL, NULL)) != 0) {
+                fatal("nng_aio_alloc", rv);
+            }
+            // A read may complete without body data (f.i. a chunk header)
+            read_buf_.clear();
+            while (read_buf_.empty() && size > 0 && !body_reader_->done()) {
+                body_reader_->read(conn_, read_aio_, size);
+                nng_aio_wait(read_aio_);
+                if ((rv = nng_aio_result(read_aio_)) != 0) {
+                    fatal("nng_http_conn_read", rv);
+                }
+                body_reader_->complete(read_aio_, read_buf_);
+            }
+            memcpy(buf, read_buf_.data(), read_buf_.size());
+            return read_buf_.size();
+        }
+
+        string_view getUriView() const override { return uri_; }
+
+        string_view getPathView() const override { return path_; }
+
+        string_view getUriParameterView(string_view key) const override
+        {
+            for (size_t i = 0; i < params_.size(); ++i) {
+                if ((*param_names_)[i] == key) {
+                    return string_view(params_[i].first, params_[i].second);
+                }
             }
-            return retval;
+            return string_view();
         }
 
-        std::string getBody() const override { return body_; }
+        string_view getHeaderView(const char* key) const override
+        {
+            return string_view(nng_http_req_get_header(req_, key));
+        }
 
-        std::map<std::string, std::string> uri_parameters_;
-        std::map<std::string, std::string> queries_;
-        std::string body_;
-    };  // namespace
+        string_view getBodyView() const override { return body_; }
+    };
 
     class ResponseImpl : public rest::Response
     {
@@ -180,202 +450,1778 @@ zFX5yAtcD5BnoPBo0CE5y/I=
             if ((rv = nng_http_res_copy_data(res_, data, size)) != 0) {
                 fatal("nng_http_res_copy_data", rv);
             }
+            body_owner_.reset();
+            body_source_ = nullptr;
+        }
+
+        void setBody(const std::string& data) override
+        {
+            setBody(data.data(), data.size());
+        }
+
+        void setBody(std::string&& data) override
+        {
+            auto body = std::make_shared<std::string>(std::move(data));
+            setOwnedBody(body, body->data(), body->size());
+        }
+
+        void setBody(std::vector<uint8_t>&& data) override
+        {
+            auto body = std::make_shared<std::vector<uint8_t>>(std::move(data));
+            setOwnedBody(body, body->data(), body->size());
+        }
+
+        void setBody(Payload data) override
+        {
+            if (!data) {
+                setBody(nullptr, 0);
+                return;
+            }
+            setOwnedBody(data, data->data(), data->size());
+        }
+
+        void setBodySource(rest::BodySource source, int64_t length) override
+        {
+            setBody(nullptr, 0);
+            body_source_ = std::move(source);
+            body_length_ = length;
+        }
+
+        const rest::BodySource& bodySource() const { return body_source_; }
+        int64_t bodyLength() const { return body_length_; }
+
+        // Owner of a body set without copying, if any. The response must be
+        // written before the owner is released.
+        const std::shared_ptr<const void>& bodyOwner() const
+        {
+            return body_owner_;
+        }
+
+        // Forget any body set
+        void clearBody() { setBody(nullptr, 0); }
+
+    private:
+        std::shared_ptr<const void> body_owner_;
+        rest::BodySource body_source_;
+        int64_t body_length_{-1};
+
+        void setOwnedBody(std::shared_ptr<const void> owner,
+                          const void* data,
+                          size_t size)
+        {
+            int rv;
+            if ((rv = nng_http_res_set_data(res_, data, size)) != 0) {
+                fatal("nng_http_res_set_data", rv);
+            }
+            body_owner_  = std::move(owner);
+            body_source_ = nullptr;
+        }
+    };
+
+    // Pool of reusable aios, for transfers done on behalf of handlers. An aio
+    // can't be freed from its own callback, so they are recycled instead.
+    class AioPool
+    {
+    public:
+        struct Item {
+            nng_aio* aio{nullptr};
+            // Called once, on completion of the next transfer. May release
+            // the item, or set a new callback for another transfer.
+            std::function<void(Item*)> callback;
+        };
+
+        ~AioPool()
+        {
+            // Stops (and waits for) any transfer still in progress
+            for (auto& item : items_) {
+                nng_aio_free(item->aio);
+            }
+        }
+
+        Item* acquire(std::function<void(Item*)> callback)
+        {
+            Item* item = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!free_.empty()) {
+                    item = free_.back();
+                    free_.pop_back();
+                }
+            }
+            if (item == nullptr) {
+                std::unique_ptr<Item> new_item(new Item);
+                int rv;
+                if ((rv = nng_aio_alloc(
+                         &new_item->aio,
+                         [](void* arg) {
+                             Item* item = (Item*)arg;
+                             // Moved out first, as the callback may release
+                             // the item, which may then be acquired and
+                             // given a new callback while this one runs
+                             std::function<void(Item*)> callback;
+                             callback.swap(item->callback);
+                             callback(item);
+                         },
+                         new_item.get())) != 0) {
+                    fatal("nng_aio_alloc", rv);
+                }
+                item = new_item.get();
+                std::lock_guard<std::mutex> lock(mutex_);
+                items_.push_back(std::move(new_item));
+            }
+            nng_aio_set_timeout(item->aio, NNG_DURATION_DEFAULT);
+            item->callback = std::move(callback);
+            return item;
         }
 
-        void setBody(const std::string& data) override
-        {
-            setBody(data.data(), data.size());
-        }
-    };
+        void release(Item* item)
+        {
+            // Drop whatever a callback not called holds on to
+            item->callback = nullptr;
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(item);
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Item>> items_;
+        std::vector<Item*> free_;
+    };
+
+    struct RouteTokenImpl : public Token {
+        using fn_type = std::function<void(void)>;
+        fn_type fn_;
+        RouteTokenImpl(fn_type fn) : fn_(fn) {}
+        ~RouteTokenImpl() { fn_(); }
+    };
+
+    // Heartbeats are only sent with both an interval and a message set
+    static bool sendsHeartbeats(const websocket::Options& options)
+    {
+        return options.heartbeat_interval_ms > 0 &&
+               !options.heartbeat_message.empty();
+    }
+
+    struct StreamInternalImpl
+        : websocket::Writer,
+          detail::TimingWheel::Client,
+          std::enable_shared_from_this<StreamInternalImpl> {
+        nng_aio* aio_read_;
+        nng_aio* aio_write_;
+        nng_stream* s_;
+        // The handler, destroyed by stop(). Held while it is called, so
+        // stop() waits for a call in progress.
+        std::mutex client_mutex_;
+        std::unique_ptr<websocket::Reader> client_;
+        // Worker threads to call the handler on, or nullptr to call it on
+        // the nng threads
+        detail::ThreadPool* workers_;
+        // Runs the handler on the worker threads, one message at a time.
+        // Created on the first message, idle connections do without.
+        std::shared_ptr<detail::Strand> strand_;
+
+        // Messages waiting for the handler. Receiving pauses while too many
+        // are waiting, so a slow handler holds back the client, instead of
+        // messages piling up.
+        static const size_t max_pending = 64;
+        std::mutex recv_mutex_;
+        size_t pending_{0};
+        bool recv_paused_{false};
+        // Set once the endpoint is gone, no more receiving or disposing
+        bool stopped_{false};
+        // When last received from, for the idle timeout
+        std::atomic<nng_time> last_recv_;
+
+        // Outbound queue, drained by the write callback. The message being
+        // written is kept in current_.
+        struct Outgoing {
+            Payload data;
+            SendCallback done;
+            // Empty if not keyed
+            std::string key;
+        };
+        std::mutex send_mutex_;
+        // Signalled when the queue shrinks, or the connection fails
+        std::condition_variable send_room_;
+        detail::LazyDeque<Outgoing> send_queue_;
+        // Size of the queued messages
+        size_t queued_bytes_{0};
+        Outgoing current_;
+        bool sending_{false};
+        bool send_failed_{false};
+        // When last done sending, for heartbeats
+        nng_time last_send_;
+        // Options of the endpoint, for the queue limits and timers
+        std::shared_ptr<const websocket::Options> options_;
+
+        using Disposer = std::function<void(StreamInternalImpl*)>;
+        Disposer disposer_;
+        StreamInternalImpl(nng_stream* s,
+                           Disposer fn_dispose,
+                           detail::ThreadPool* workers,
+                           std::shared_ptr<const websocket::Options> options)
+            : aio_read_(nullptr)
+            , s_(s)
+            , workers_(workers)
+            , last_recv_(nng_clock())
+            , last_send_(nng_clock())
+            , options_(std::move(options))
+            , disposer_(fn_dispose)
+        {
+            int rv;
+            if ((rv = nng_aio_alloc(
+                     &aio_read_,
+                     [](void* arg) {
+                         StreamInternalImpl* pThis = (StreamInternalImpl*)arg;
+                         pThis->stream_recv_cb();
+                     },
+                     this)) != 0) {
+                fatal("nng_aio_alloc read", rv);
+            }
+            if ((rv = nng_aio_alloc(
+                     &aio_write_,
+                     [](void* arg) {
+                         StreamInternalImpl* pThis = (StreamInternalImpl*)arg;
+                         pThis->stream_send_cb();
+                     },
+                     this)) != 0) {
+                fatal("nng_aio_alloc write", rv);
+            }
+        }
+
+        // Create the handler and start receiving. Not done by the
+        // constructor, so the handler may share ownership of the stream,
+        // f.i. by adding it to a group.
+        void start(const websocket::Factory& factory)
+        {
+            // Under the lock, so stop() returns only once the factory is
+            // done, or when it never gets called
+            std::lock_guard<std::mutex> lock(recv_mutex_);
+            if (!stopped_) {
+                client_.reset(factory(*this));
+                startReceive();
+            }
+        }
+
+        ~StreamInternalImpl()
+        {
+            cancel();
+            nng_stream_free(s_);
+            nng_aio_free(aio_read_);
+            nng_aio_free(aio_write_);
+            // Messages queued after the connection went down
+            for (auto& msg : send_queue_) {
+                if (msg.done) {
+                    msg.done(false);
+                }
+            }
+        }
+
+        // Receive the next message, of whatever size, the stream being in
+        // message mode
+        void startReceive() { nng_stream_recv(s_, aio_read_); }
+
+        // Detach from the endpoint, which is going away. The handler is
+        // destroyed here, as it was before messages were queued for it,
+        // while the stream itself may live on in messages still queued,
+        // which are dropped.
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(recv_mutex_);
+                stopped_ = true;
+            }
+            cancel();
+            std::unique_ptr<websocket::Reader> client;
+            {
+                std::lock_guard<std::mutex> lock(client_mutex_);
+                client = std::move(client_);
+            }
+        }
+
+        void cancel()
+        {
+            {
+                // No more writes started
+                std::lock_guard<std::mutex> lock(send_mutex_);
+                send_failed_ = true;
+            }
+            send_room_.notify_all();
+            nng_aio_cancel(aio_read_);
+            nng_aio_wait(aio_read_);
+            nng_aio_cancel(aio_write_);
+            nng_aio_wait(aio_write_);
+        }
+
+        void stream_recv_cb()
+        {
+            int rv = nng_aio_result(aio_read_);
+            switch (rv) {
+            case 0: {
+                last_recv_   = nng_clock();
+                nng_msg* msg = detail::takeMessage(aio_read_);
+                std::string data((char*)nng_msg_body(msg), nng_msg_len(msg));
+                nng_msg_free(msg);
+                if (workers_ == nullptr) {
+                    // Received again only after the handler returns, to
+                    // keep messages in order
+                    deliver(data);
+                    startReceive();
+                    break;
+                }
+                if (!strand_) {
+                    // Only touched here, with one receive at a time
+                    strand_ = std::make_shared<detail::Strand>(*workers_);
+                }
+                // Call handler on a worker thread, since threads created by
+                // nng have rather small stack size. The strand keeps the
+                // messages in order, without blocking this thread.
+                bool receive;
+                {
+                    std::lock_guard<std::mutex> lock(recv_mutex_);
+                    receive      = ++pending_ < max_pending;
+                    recv_paused_ = !receive;
+                }
+                auto self = shared_from_this();
+                strand_->post([self, data] {
+                    self->deliver(data);
+                    self->delivered();
+                });
+                if (receive) {
+                    startReceive();
+                }
+            } break;
+            case NNG_ECANCELED:
+                break;
+            default: {
+                // Closed, or closed by nng on a protocol error, f.i. a
+                // message larger than the max message size
+                std::lock_guard<std::mutex> lock(recv_mutex_);
+                if (!stopped_) {
+                    disposer_(this);
+                }
+            } break;
+            }
+        }
+
+        void deliver(const std::string& data)
+        {
+            std::lock_guard<std::mutex> lock(client_mutex_);
+            if (!client_) {
+                // Stopped
+                return;
+            }
+            try {
+                client_->onMessage(data);
+            } catch (...) {
+                // TODO
+            }
+        }
+
+        // A message has been handled, resume receiving if paused
+        void delivered()
+        {
+            bool receive = false;
+            {
+                std::lock_guard<std::mutex> lock(recv_mutex_);
+                --pending_;
+                if (recv_paused_ && !stopped_) {
+                    recv_paused_ = false;
+                    receive      = true;
+                }
+            }
+            if (receive) {
+                startReceive();
+            }
+        }
+
+        void send(const std::string& data) override
+        {
+            queue(std::make_shared<const std::string>(data), nullptr);
+        }
+
+        void send(const std::string& data, SendCallback done) override
+        {
+            queue(std::make_shared<const std::string>(data), std::move(done));
+        }
+
+        void send(Payload data, SendCallback done) override
+        {
+            queue(std::move(data), std::move(done));
+        }
+
+        void sendKeyed(const std::string& key,
+                       Payload data,
+                       SendCallback done) override
+        {
+            queue(std::move(data), std::move(done), key);
+        }
+
+        // Queue a message. Unless wait is set, a message that would have
+        // to wait for room (OverflowPolicy::Block) isn't queued, and false
+        // is returned.
+        bool queue(Payload data,
+                   SendCallback done,
+                   const std::string& key = std::string(),
+                   bool wait              = true)
+        {
+            Outgoing msg{std::move(data), std::move(done), key};
+            std::deque<Outgoing> dropped;
+            {
+                std::unique_lock<std::mutex> lock(send_mutex_);
+                if (!wait && !send_failed_ &&
+                    options_->overflow_policy ==
+                        websocket::OverflowPolicy::Block &&
+                    !fits(msg.data->size())) {
+                    return false;
+                }
+                if (send_failed_ || !makeRoom(msg, lock, dropped)) {
+                    dropped.push_back(std::move(msg));
+                } else {
+                    queued_bytes_ += msg.data->size();
+                    send_queue_.push_back(std::move(msg));
+                    if (!sending_) {
+                        sending_ = true;
+                        startSend();
+                    }
+                }
+            }
+            for (auto& msg : dropped) {
+                if (msg.done) {
+                    msg.done(false);
+                }
+            }
+            return true;
+        }
+
+        // True if a message of the given size fits in the queue. Called
+        // with send_mutex_ held.
+        bool fits(size_t size) const
+        {
+            if (send_queue_.empty()) {
+                return true;
+            }
+            const auto& options = *options_;
+            return (options.max_queued_messages == 0 ||
+                    send_queue_.size() < options.max_queued_messages) &&
+                   (options.max_queued_bytes == 0 ||
+                    queued_bytes_ + size <= options.max_queued_bytes);
+        }
+
+        // Make room for a message in the queue, as the overflow policy
+        // says. Returns false if the message isn't to be queued, in which
+        // case msg is dropped: either the message itself, or the queued
+        // message it replaced. Messages dropped to make room are moved to
+        // dropped. Called with send_mutex_ held.
+        bool makeRoom(Outgoing& msg,
+                      std::unique_lock<std::mutex>& lock,
+                      std::deque<Outgoing>& dropped)
+        {
+            using websocket::OverflowPolicy;
+            const auto policy = options_->overflow_policy;
+            auto counters     = options_->overflow_counters.get();
+            if (policy == OverflowPolicy::Coalesce && !msg.key.empty()) {
+                // Linear, the queue is expected to be short with limits
+                for (auto& queued : send_queue_) {
+                    if (queued.key == msg.key) {
+                        queued_bytes_ -= queued.data->size();
+                        queued_bytes_ += msg.data->size();
+                        std::swap(queued, msg);
+                        if (counters != nullptr) {
+                            ++counters->coalesced;
+                        }
+                        return false;
+                    }
+                }
+            }
+            const size_t size = msg.data->size();
+            if (fits(size)) {
+                return true;
+            }
+            switch (policy) {
+            case OverflowPolicy::Block:
+                if (counters != nullptr) {
+                    ++counters->blocked;
+                }
+                send_room_.wait(
+                    lock, [&] { return send_failed_ || fits(size); });
+                return !send_failed_;
+            case OverflowPolicy::DropNewest:
+                if (counters != nullptr) {
+                    ++counters->dropped_newest;
+                }
+                return false;
+            case OverflowPolicy::DropOldest:
+            case OverflowPolicy::Coalesce:
+                while (!fits(size)) {
+                    queued_bytes_ -= send_queue_.front().data->size();
+                    dropped.push_back(std::move(send_queue_.front()));
+                    send_queue_.pop_front();
+                    if (counters != nullptr) {
+                        ++counters->dropped_oldest;
+                    }
+                }
+                return true;
+            case OverflowPolicy::Disconnect:
+                if (counters != nullptr) {
+                    ++counters->disconnected;
+                }
+                failQueue(dropped);
+                // Disposed of once the pending receive fails
+                nng_stream_close(s_);
+                return false;
+            }
+            return false;
+        }
+
+        // No more sending, the queued messages are moved to failed. Called
+        // with send_mutex_ held.
+        void failQueue(std::deque<Outgoing>& failed)
+        {
+            send_failed_ = true;
+            for (auto& msg : send_queue_) {
+                failed.push_back(std::move(msg));
+            }
+            send_queue_.clear();
+            queued_bytes_ = 0;
+            send_room_.notify_all();
+        }
+
+        // Start writing the next queued message. Called with send_mutex_
+        // held.
+        void startSend()
+        {
+            current_ = std::move(send_queue_.front());
+            send_queue_.pop_front();
+            queued_bytes_ -= current_.data->size();
+            send_room_.notify_all();
+            const int rv = detail::setMessage(
+                aio_write_, current_.data->data(), current_.data->size());
+            if (rv != 0) {
+                // Fail it through the write callback
+                if (nng_aio_begin(aio_write_)) {
+                    nng_aio_finish(aio_write_, rv);
+                }
+                return;
+            }
+            nng_stream_send(s_, aio_write_);
+        }
+
+        void stream_send_cb()
+        {
+            const int rv = nng_aio_result(aio_write_);
+            // Not consumed if the send failed
+            nng_msg* msg = detail::takeMessage(aio_write_);
+            if (msg != nullptr) {
+                nng_msg_free(msg);
+            }
+            Outgoing sent;
+            std::deque<Outgoing> failed;
+            {
+                std::lock_guard<std::mutex> lock(send_mutex_);
+                sent       = std::move(current_);
+                last_send_ = nng_clock();
+                if (rv != 0) {
+                    // The connection is gone, or going
+                    failQueue(failed);
+                }
+                if (!send_queue_.empty()) {
+                    startSend();
+                } else {
+                    sending_ = false;
+                }
+            }
+            if (sent.done) {
+                sent.done(rv == 0);
+            }
+            for (auto& msg : failed) {
+                if (msg.done) {
+                    msg.done(false);
+                }
+            }
+        }
+
+        // Delay until the first heartbeat or idle timeout is due, in ms
+        nng_duration timerDelay() const
+        {
+            const auto& options = *options_;
+            if (sendsHeartbeats(options) &&
+                (options.idle_timeout_ms <= 0 ||
+                 options.heartbeat_interval_ms < options.idle_timeout_ms)) {
+                return options.heartbeat_interval_ms;
+            }
+            return options.idle_timeout_ms;
+        }
+
+        // Close the connection if idle for too long, else send a heartbeat
+        // if due
+        nng_duration onTimer(nng_time now) override
+        {
+            const auto& options = *options_;
+            {
+                std::lock_guard<std::mutex> lock(recv_mutex_);
+                if (stopped_) {
+                    return 0;
+                }
+            }
+            nng_duration delay = 0;
+            if (options.idle_timeout_ms > 0) {
+                const nng_time idle = now - std::min<nng_time>(now, last_recv_);
+                if (idle >= (nng_time)options.idle_timeout_ms) {
+                    // Disposed of once the pending receive fails
+                    nng_stream_close(s_);
+                    return 0;
+                }
+                delay = options.idle_timeout_ms - (nng_duration)idle;
+            }
+            if (sendsHeartbeats(options)) {
+                const nng_duration next = heartbeat(now);
+                delay = delay > 0 ? std::min(delay, next) : next;
+            }
+            return delay;
+        }
+
+        // Send a heartbeat if nothing has been sent for the heartbeat
+        // interval. Never waits, unlike send(). Returns the delay until the
+        // next heartbeat is due, in ms.
+        nng_duration heartbeat(nng_time now)
+        {
+            const nng_duration interval = options_->heartbeat_interval_ms;
+            std::lock_guard<std::mutex> lock(send_mutex_);
+            if (sending_ || send_failed_) {
+                // Not quiet
+                return interval;
+            }
+            const nng_time quiet = now - std::min(now, last_send_);
+            if (quiet < (nng_time)interval) {
+                return interval - (nng_duration)quiet;
+            }
+            send_queue_.push_back(
+                {std::make_shared<const std::string>(
+                     options_->heartbeat_message),
+                 nullptr,
+                 std::string()});
+            queued_bytes_ += send_queue_.back().data->size();
+            sending_ = true;
+            startSend();
+            return interval;
+        }
+    };
+
+    class GroupImpl : public websocket::Group
+    {
+    public:
+        void add(websocket::Writer& writer) override
+        {
+            auto stream = toStream(writer);
+            std::lock_guard<std::mutex> lock(mutex_);
+            members_[stream.get()] = stream;
+        }
+
+        void remove(websocket::Writer& writer) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            members_.erase(dynamic_cast<StreamInternalImpl*>(&writer));
+        }
+
+        size_t size() const override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t n = 0;
+            for (const auto& member : members_) {
+                n += member.second.expired() ? 0 : 1;
+            }
+            return n;
+        }
+
+        size_t broadcast(Payload data) override
+        {
+            return fanOut(std::string(), std::move(data));
+        }
+
+        size_t broadcastKeyed(const std::string& key, Payload data) override
+        {
+            return fanOut(key, std::move(data));
+        }
+
+    private:
+        // Queued outside of the lock, as queueing may fail a send and call
+        // back into the group. Members that would block for room are waited
+        // for last, so they don't hold up the others.
+        size_t fanOut(const std::string& key, const Payload& data)
+        {
+            const auto streams = members();
+            std::vector<StreamInternalImpl*> full;
+            for (const auto& stream : streams) {
+                if (!stream->queue(data, nullptr, key, false)) {
+                    full.push_back(stream.get());
+                }
+            }
+            for (auto stream : full) {
+                stream->queue(data, nullptr, key);
+            }
+            return streams.size();
+        }
+
+        // The open connections, dropping closed ones
+        std::vector<std::shared_ptr<StreamInternalImpl>> members()
+        {
+            std::vector<std::shared_ptr<StreamInternalImpl>> streams;
+            std::lock_guard<std::mutex> lock(mutex_);
+            streams.reserve(members_.size());
+            for (auto it = members_.begin(); it != members_.end();) {
+                if (auto stream = it->second.lock()) {
+                    streams.push_back(std::move(stream));
+                    ++it;
+                } else {
+                    // Closed
+                    it = members_.erase(it);
+                }
+            }
+            return streams;
+        }
+
+        mutable std::mutex mutex_;
+        std::unordered_map<StreamInternalImpl*,
+                           std::weak_ptr<StreamInternalImpl>>
+            members_;
+
+        static std::shared_ptr<StreamInternalImpl> toStream(
+            websocket::Writer& writer)
+        {
+            auto stream = dynamic_cast<StreamInternalImpl*>(&writer);
+            if (stream == nullptr) {
+                throw std::invalid_argument("Not a server websocket writer");
+            }
+            return stream->shared_from_this();
+        }
+    };
+
+    class ServerImpl : public Server,
+                       public std::enable_shared_from_this<ServerImpl>
+    {
+        // Guards route registration, REST requests are dispatched from
+        // route_table_ without locking
+        std::recursive_mutex routes_mutex_;
+        // Guards directories_ and static_responses_
+        std::mutex directories_mutex_;
+        // Guards websockets_ and reaper_. Each endpoint synchronizes its
+        // connections on its own.
+        std::mutex websockets_mutex_;
+        nng_smart_ptr<nng_http_server> server_{nng_http_server_release};
+        nng_smart_ptr<nng_tls_config> tls_cfg_{nng_tls_config_free};
+        bool started_{false};
+        // Aios for transfers on behalf of handlers
+        AioPool aio_pool_;
+        // Worker threads for callbacks, or nullptr to call back on the nng
+        // threads. Declared after aio_pool_, as workers may use it.
+        std::unique_ptr<detail::ThreadPool> workers_;
+        // Destroys closed websocket connections, created with the first
+        // websocket endpoint
+        std::unique_ptr<detail::ThreadPool> reaper_;
+        // Heartbeats and idle timeouts of all websocket connections,
+        // created with the first endpoint using either. Declared after
+        // reaper_, which it releases connections on.
+        std::unique_ptr<detail::TimingWheel> timers_;
+
+        struct route {
+            std::string method;
+            std::string uri;
+            std::vector<std::string> uri_param_key;
+            // One of these is set
+            rest::Handler handler;
+            rest::AsyncHandler async_handler;
+            rest::RouteOptions options;
+        };
+        using route_ptr = std::shared_ptr<const route>;
+
+        // Immutable snapshot of all routes, used for request dispatch.
+        // Requests in flight keep their snapshot (and thereby the matched
+        // route) alive, while route changes publish a new snapshot.
+        struct route_table {
+            std::map<std::string,  // Method
+                     detail::Router<route_ptr>>
+                routers;
+        };
+
+        // What a directory handler serves, owned by the handler data like
+        // static_response::content, so removing the directory doesn't free
+        // it under a request in progress
+        struct directory_state {
+            // Requests for more ranges are served the whole file
+            static const size_t max_ranges = 16;
+
+            // Directory URI, without trailing '/'
+            std::string uri_;
+            std::string path_;
+            const DirectoryOptions options_;
+            std::unique_ptr<detail::FileCache> cache_;
+            AioPool& aio_pool_;
+            // Range bodies are read on these, if set
+            detail::ThreadPool* workers_;
+            std::map<std::string, std::string> additional_headers;
+            // Files compiled into the executable, by relative path, served
+            // instead of the filesystem if embedded
+            bool embedded_{false};
+            std::unordered_map<std::string, detail::FileEntryPtr>
+                embedded_files_;
+
+            directory_state(const std::string& uri,
+                            const std::string& path,
+                            const DirectoryOptions& options,
+                            AioPool& aio_pool,
+                            detail::ThreadPool* workers)
+                : uri_(uri)
+                , path_(path)
+                , options_(options)
+                , aio_pool_(aio_pool)
+                , workers_(workers)
+                , additional_headers(options.headers)
+            {
+                while (path_.size() > 1 && path_.back() == '/') {
+                    path_.pop_back();
+                }
+                if (options_.cache) {
+                    cache_.reset(new detail::FileCache(options_.cache_size));
+                }
+                trimUri();
+            }
+
+            directory_state(const std::string& uri,
+                            const embedded::Directory& files,
+                            const DirectoryOptions& options,
+                            AioPool& aio_pool,
+                            detail::ThreadPool* workers)
+                : uri_(uri)
+                , options_(options)
+                , aio_pool_(aio_pool)
+                , workers_(workers)
+                , additional_headers(options.headers)
+                , embedded_(true)
+            {
+                for (size_t i = 0; i < files.count; ++i) {
+                    const auto& file = files.files[i];
+                    auto entry       = embeddedEntry(
+                        file, file.data, file.size, file.etag, nullptr);
+                    if (options_.precompressed) {
+                        if (file.brotli_data != nullptr) {
+                            entry->brotli = embeddedEntry(file,
+                                                          file.brotli_data,
+                                                          file.brotli_size,
+                                                          file.etag,
+                                                          "br");
+                        }
+                        if (file.gzip_data != nullptr) {
+                            entry->gzip = embeddedEntry(file,
+                                                        file.gzip_data,
+                                                        file.gzip_size,
+                                                        file.etag,
+                                                        "gzip");
+                        }
+                        entry->vary = entry->brotli || entry->gzip;
+                    }
+                    embedded_files_[file.path] = std::move(entry);
+                }
+                trimUri();
+            }
+
+            void trimUri()
+            {
+                while (!uri_.empty() && uri_.back() == '/') {
+                    uri_.pop_back();
+                }
+            }
+
+            static void handle(nng_aio* aio)
+            {
+                nng_http_req* req = (nng_http_req*)nng_aio_get_input(aio, 0);
+                nng_http_handler* h =
+                    (nng_http_handler*)nng_aio_get_input(aio, 1);
+                // Kept until the response is on its way
+                const std::shared_ptr<directory_state> state =
+                    *(std::shared_ptr<directory_state>*)
+                        nng_http_handler_get_data(h);
+                directory_state* dir = state.get();
+                nng_http_res* res;
+                int rv;
+
+                // The handler is only called for paths below its URI
+                const auto path = RequestImpl::path(req);
+                std::string file;
+                detail::decodePercent(path.data() + dir->uri_.size(),
+                                      path.size() - dir->uri_.size(),
+                                      file,
+                                      false);
+                detail::FileEntryPtr entry;
+                if (isSafe(file)) {
+                    entry = dir->find(file);
+                }
+                if (entry) {
+                    entry = selectEncoding(req, entry);
+                }
+                if (entry && notModified(req, *entry)) {
+                    // Answered before reading any of the file
+                    if ((rv = nng_http_res_alloc(&res)) != 0) {
+                        nng_aio_finish(aio, rv);
+                        return;
+                    }
+                    nng_http_res_set_status(res, NNG_HTTP_STATUS_NOT_MODIFIED);
+                    dir->addHeaders(res, *entry);
+                    finishRest(aio, res);
+                    return;
+                }
+                if (entry && sendRanges(aio, req, entry, dir)) {
+                    return;
+                }
+                if (entry && !entry->inMemory()) {
+                    entry = load(std::move(entry));
+                }
+                if (!entry) {
+                    if ((rv = nng_http_res_alloc_error(
+                             &res, NNG_HTTP_STATUS_NOT_FOUND)) != 0) {
+                        nng_aio_finish(aio, rv);
+                        return;
+                    }
+                    finishRest(aio, res);
+                    return;
+                }
+
+                if ((rv = nng_http_res_alloc(&res)) != 0) {
+                    nng_aio_finish(aio, rv);
+                    return;
+                }
+                nng_http_res_set_header(
+                    res, "Content-Type", entry->mime_type.c_str());
+                dir->addHeaders(res, *entry);
+                nng_http_res_set_data(res, entry->content, entry->content_size);
+                sendOwned(aio, res, entry, dir->aio_pool_);
+            }
+
+            // Send the requested parts of a file, if only parts are
+            // requested. Returns false to send the whole file.
+            static bool sendRanges(nng_aio* aio,
+                                   nng_http_req* req,
+                                   const detail::FileEntryPtr& entry,
+                                   directory_state* dir)
+            {
+                const char* range = nng_http_req_get_header(req, "Range");
+                if (range == nullptr ||
+                    strcmp(nng_http_req_get_method(req), "GET") != 0 ||
+                    !ifRangeMatches(req, *entry)) {
+                    return false;
+                }
+                const uint64_t size =
+                    entry->inMemory() ? entry->content_size : entry->stat.size;
+                std::vector<detail::ByteRange> ranges;
+                const auto result =
+                    detail::parseRanges(range, size, max_ranges, ranges);
+                if (result == detail::RangeResult::Ignore) {
+                    return false;
+                }
+
+                nng_http_res* res;
+                int rv;
+                if ((rv = nng_http_res_alloc(&res)) != 0) {
+                    nng_aio_finish(aio, rv);
+                    return true;
+                }
+                dir->addHeaders(res, *entry);
+                if (result == detail::RangeResult::Unsatisfiable) {
+                    nng_http_res_set_status(
+                        res, NNG_HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+                    nng_http_res_set_header(
+                        res,
+                        "Content-Range",
+                        ("bytes */" + std::to_string(size)).c_str());
+                    finishRest(aio, res);
+                    return true;
+                }
+
+                auto contentRange = [size](const detail::ByteRange& r) {
+                    return "bytes " + std::to_string(r.first) + "-" +
+                           std::to_string(r.last) + "/" +
+                           std::to_string(size);
+                };
+                nng_http_res_set_status(res, NNG_HTTP_STATUS_PARTIAL_CONTENT);
+                auto body   = std::make_shared<range_body>();
+                body->entry = entry;
+                if (ranges.size() == 1) {
+                    const auto& r = ranges.front();
+                    nng_http_res_set_header(
+                        res, "Content-Type", entry->mime_type.c_str());
+                    nng_http_res_set_header(
+                        res, "Content-Range", contentRange(r).c_str());
+                    if (entry->inMemory()) {
+                        // Straight from the cached or embedded file
+                        nng_http_res_set_data(res,
+                                              entry->content + r.first,
+                                              static_cast<size_t>(r.length()));
+                        sendOwned(aio, res, entry, dir->aio_pool_);
+                        return true;
+                    }
+                    body->parts.push_back(range_body::part{"", r});
+                } else {
+                    char boundary[32];
+                    snprintf(boundary,
+                             sizeof(boundary),
+                             "siesta-%08x%08x",
+                             (unsigned)nng_random(),
+                             (unsigned)nng_random());
+                    nng_http_res_set_header(
+                        res,
+                        "Content-Type",
+                        (std::string("multipart/byteranges; boundary=") +
+                         boundary)
+                            .c_str());
+                    for (const auto& r : ranges) {
+                        body->parts.push_back(range_body::part{
+                            std::string("--") + boundary +
+                                "\r\nContent-Type: " + entry->mime_type +
+                                "\r\nContent-Range: " + contentRange(r) +
+                                "\r\n\r\n",
+                            r});
+                    }
+                    body->separator = "\r\n";
+                    body->tail      = std::string("--") + boundary + "--\r\n";
+                }
+                if (!entry->inMemory()) {
+                    body->reader.reset(new detail::FileReader(entry->path));
+                    if (!body->reader->isOpen()) {
+                        // The file went away
+                        nng_http_res_free(res);
+                        if ((rv = nng_http_res_alloc_error(
+                                 &res,
+                                 NNG_HTTP_STATUS_INTERNAL_SERVER_ERROR)) != 0) {
+                            nng_aio_finish(aio, rv);
+                            return true;
+                        }
+                        finishRest(aio, res);
+                        return true;
+                    }
+                }
+
+                // Only the requested parts are read, a piece at a time, as
+                // the client takes them
+                const int64_t length = static_cast<int64_t>(body->length());
+                BodyStream::start(
+                    aio,
+                    res,
+                    [body](std::string& chunk) { return body->next(chunk); },
+                    length,
+                    body,
+                    dir->aio_pool_,
+                    dir->workers_,
+                    false);
+                return true;
+            }
+
+            // Body of a range response
+            struct range_body {
+                struct part {
+                    std::string head;
+                    detail::ByteRange range;
+                };
+
+                detail::FileEntryPtr entry;
+                // Set unless the file is in memory
+                std::unique_ptr<detail::FileReader> reader;
+                std::vector<part> parts;
+                // Written after the data of each part, and after the parts
+                std::string separator;
+                std::string tail;
+                // Position in the parts
+                size_t index{0};
+                uint64_t offset{0};
+                bool tail_sent{false};
+
+                uint64_t length() const
+                {
+                    uint64_t n = tail.size();
+                    for (const auto& p : parts) {
+                        n += p.head.size() + p.range.length() +
+                             separator.size();
+                    }
+                    return n;
+                }
+
+                /**
+                 * Append the next piece of the body to chunk, returning false
+                 * once done.
+                 *
+                 * @throws std::runtime_error if the file can't be read
+                 */
+                bool next(std::string& chunk)
+                {
+                    if (index == parts.size()) {
+                        if (tail_sent) {
+                            return false;
+                        }
+                        chunk += tail;
+                        tail_sent = true;
+                        return true;
+                    }
+                    const part& p = parts[index];
+                    if (offset == 0) {
+                        chunk += p.head;
+                    }
+                    const uint64_t first = p.range.first + offset;
+                    const uint64_t n = std::min<uint64_t>(
+                        p.range.length() - offset, 64 * 1024);
+                    if (reader) {
+                        if (!reader->read(first, n, chunk)) {
+                            // The file changed
+                            throw std::runtime_error("Failed to read file");
+                        }
+                    } else {
+                        chunk.append(entry->content + first,
+                                     static_cast<size_t>(n));
+                    }
+                    offset += n;
+                    if (offset == p.range.length()) {
+                        chunk += separator;
+                        ++index;
+                        offset = 0;
+                    }
+                    return true;
+                }
+            };
 
-    struct RouteTokenImpl : public Token {
-        using fn_type = std::function<void(void)>;
-        fn_type fn_;
-        RouteTokenImpl(fn_type fn) : fn_(fn) {}
-        ~RouteTokenImpl() { fn_(); }
-    };
+            // Pick a precompressed variant of a file, if the client accepts
+            // it
+            static detail::FileEntryPtr selectEncoding(
+                nng_http_req* req,
+                const detail::FileEntryPtr& entry)
+            {
+                const char* accept =
+                    nng_http_req_get_header(req, "Accept-Encoding");
+                if (accept == nullptr || !entry->vary) {
+                    return entry;
+                }
+                if (entry->brotli && detail::acceptsEncoding(accept, "br")) {
+                    return entry->brotli;
+                }
+                if (entry->gzip && detail::acceptsEncoding(accept, "gzip")) {
+                    return entry->gzip;
+                }
+                return entry;
+            }
 
-    struct StreamInternalImpl : websocket::Writer {
-        nng_aio* aio_read_;
-        nng_aio* aio_write_;
-        nng_stream* s_;
-        std::unique_ptr<websocket::Reader> client_;
-        std::vector<uint8_t> rec_buffer;
-        const bool callback_on_new_thread_;
+            // True unless an If-Range header doesn't match the file
+            static bool ifRangeMatches(nng_http_req* req,
+                                       const detail::FileEntry& entry)
+            {
+                const char* hdr = nng_http_req_get_header(req, "If-Range");
+                if (hdr == nullptr) {
+                    return true;
+                }
+                if (hdr[0] == '"' || hdr[0] == 'W') {
+                    // Strong comparison
+                    return entry.etag == hdr;
+                }
+                int64_t date;
+                return !entry.last_modified.empty() &&
+                       detail::parseHttpDate(hdr, date) &&
+                       date == entry.stat.mtime;
+            }
 
-        using Disposer = std::function<void(StreamInternalImpl*)>;
-        Disposer disposer_;
-        StreamInternalImpl(websocket::Factory factory,
-                           nng_stream* s,
-                           Disposer fn_dispose,
-                           bool callback_on_new_thread)
-            : aio_read_(nullptr)
-            , rec_buffer(32768)
-            , s_(s)
-            , disposer_(fn_dispose)
-            , callback_on_new_thread_(callback_on_new_thread)
-        {
-            int rv;
-            if ((rv = nng_aio_alloc(
-                     &aio_read_,
-                     [](void* arg) {
-                         StreamInternalImpl* pThis = (StreamInternalImpl*)arg;
-                         pThis->stream_recv_cb();
-                     },
-                     this)) != 0) {
-                fatal("nng_aio_alloc read", rv);
+            // Validators and caching policy of a file
+            void addHeaders(nng_http_res* res, const detail::FileEntry& entry)
+            {
+                nng_http_res_set_header(res, "Accept-Ranges", "bytes");
+                nng_http_res_set_header(res, "ETag", entry.etag.c_str());
+                if (!entry.encoding.empty()) {
+                    nng_http_res_set_header(
+                        res, "Content-Encoding", entry.encoding.c_str());
+                }
+                if (entry.vary) {
+                    nng_http_res_set_header(res, "Vary", "Accept-Encoding");
+                }
+                if (!entry.last_modified.empty()) {
+                    nng_http_res_set_header(
+                        res, "Last-Modified", entry.last_modified.c_str());
+                }
+                if (!options_.cache_control.empty()) {
+                    nng_http_res_set_header(
+                        res, "Cache-Control", options_.cache_control.c_str());
+                }
+                for (const auto& header : additional_headers) {
+                    nng_http_res_set_header(
+                        res, header.first.c_str(), header.second.c_str());
+                }
             }
-            if ((rv = nng_aio_alloc(&aio_write_, nullptr, nullptr)) != 0) {
-                fatal("nng_aio_alloc write", rv);
+
+            // True if the client has the current version of the file
+            static bool notModified(nng_http_req* req,
+                                    const detail::FileEntry& entry)
+            {
+                const char* hdr = nng_http_req_get_header(req, "If-None-Match");
+                if (hdr != nullptr) {
+                    // If-Modified-Since is ignored when If-None-Match is given
+                    return etagMatches(hdr, entry.etag);
+                }
+                hdr = nng_http_req_get_header(req, "If-Modified-Since");
+                int64_t since;
+                return hdr != nullptr && !entry.last_modified.empty() &&
+                       detail::parseHttpDate(hdr, since) &&
+                       entry.stat.mtime <= since;
             }
-            client_.reset(factory(*this));
-            startReceive();
-        }
 
-        ~StreamInternalImpl()
-        {
-            cancel();
-            nng_stream_free(s_);
-            nng_aio_free(aio_read_);
-            nng_aio_free(aio_write_);
-        }
+            // Weak comparison of a list of entity tags against an ETag
+            static bool etagMatches(const char* list, const std::string& etag)
+            {
+                const char* p = list;
+                for (;;) {
+                    while (*p == ' ' || *p == '\t' || *p == ',') {
+                        ++p;
+                    }
+                    if (*p == '\0') {
+                        return false;
+                    }
+                    if (*p == '*') {
+                        return true;
+                    }
+                    if (p[0] == 'W' && p[1] == '/') {
+                        p += 2;
+                    }
+                    const char* end = p;
+                    if (*end == '"') {
+                        end = strchr(end + 1, '"');
+                        end = end == nullptr ? p + strlen(p) : end + 1;
+                    } else {
+                        while (*end != '\0' && *end != ',') {
+                            ++end;
+                        }
+                    }
+                    if (static_cast<size_t>(end - p) == etag.size() &&
+                        memcmp(p, etag.data(), etag.size()) == 0) {
+                        return true;
+                    }
+                    p = end;
+                }
+            }
 
-        void startReceive()
-        {
-            nng_iov iov = {rec_buffer.data(), rec_buffer.size()};
-            nng_aio_set_iov(aio_read_, 1, &iov);
-            nng_stream_recv(s_, aio_read_);
-        }
+            // Relative paths are not allowed out of the directory
+            static bool isSafe(const std::string& file)
+            {
+                if (file.find('\0') != std::string::npos) {
+                    return false;
+                }
+#ifdef WIN32
+                if (file.find_first_of("\\:") != std::string::npos) {
+                    return false;
+                }
+#endif
+                size_t start = 0;
+                for (;;) {
+                    size_t end = file.find('/', start);
+                    if (file.compare(start,
+                                     end == std::string::npos ? end
+                                                              : end - start,
+                                     "..") == 0) {
+                        return false;
+                    }
+                    if (end == std::string::npos) {
+                        return true;
+                    }
+                    start = end + 1;
+                }
+            }
 
-        void cancel()
-        {
-            nng_aio_cancel(aio_read_);
-            nng_aio_wait(aio_read_);
-            nng_aio_cancel(aio_write_);
-            nng_aio_wait(aio_write_);
-        }
+            // Find the file for a request path, relative to the directory.
+            // Returns a cached entry, an entry without data (to be loaded),
+            // or nullptr if there is no such file.
+            detail::FileEntryPtr find(const std::string& file)
+            {
+                if (embedded_) {
+                    return findEmbedded(file);
+                }
+                if (cache_) {
+                    if (auto entry = cache_->get(file)) {
+                        return entry;
+                    }
+                }
+                auto entry  = std::make_shared<detail::FileEntry>();
+                entry->path = path_;
+                if (file.empty() || file[0] != '/') {
+                    entry->path += '/';
+                }
+                entry->path += file;
+                if (!detail::statFile(entry->path, entry->stat)) {
+                    return nullptr;
+                }
+                if (entry->stat.directory) {
+                    const std::string base =
+                        entry->path.back() == '/' ? entry->path
+                                                  : entry->path + "/";
+                    if (!detail::statFile(entry->path = base + "index.html",
+                                          entry->stat) &&
+                        !detail::statFile(entry->path = base + "index.htm",
+                                          entry->stat)) {
+                        return nullptr;
+                    }
+                    if (entry->stat.directory) {
+                        return nullptr;
+                    }
+                }
+                detail::describeFile(*entry);
+                if (options_.precompressed) {
+                    entry->brotli = findVariant(*entry, ".br", "br");
+                    entry->gzip   = findVariant(*entry, ".gz", "gzip");
+                    entry->vary   = entry->brotli || entry->gzip;
+                }
 
-        void stream_recv_cb()
-        {
-            int rv   = nng_aio_result(aio_read_);
-            auto len = nng_aio_count(aio_read_);
-            switch (rv) {
-            case 0: {
-                std::string data((char*)rec_buffer.data(), len);
-                startReceive();
-                try {
-                    if (callback_on_new_thread_) {
-                        auto f = std::async(std::launch::async,
-                                            [&] { client_->onMessage(data); });
-                        f.get();
-                    } else {
-                        client_->onMessage(data);
+                if (cache_ && entry->stat.size + variantSize(*entry) <=
+                                  cache_->maxSize()) {
+                    // Loaded, with its variants, on first use
+                    entry->setData(readData(*entry));
+                    if (entry->brotli) {
+                        entry->brotli = load(entry->brotli);
+                    }
+                    if (entry->gzip) {
+                        entry->gzip = load(entry->gzip);
+                    }
+                    if (entry->inMemory()) {
+                        cache_->put(file, entry);
                     }
-                } catch (...) {
-                    // TODO
                 }
-            } break;
-            case NNG_ECLOSED: {
-                disposer_(this);
-            } break;
-            default:
-                break;
+                return entry;
             }
-        }
 
-        void send(const std::string& data) override
-        {
-            nng_iov iov;
-            iov.iov_buf = (void*)data.data();
-            iov.iov_len = data.size();
-            int rv      = nng_aio_set_iov(aio_write_, 1, &iov);
-            if (rv != 0) {
-                fatal("nng_aio_set_iov", rv);
+            // Find a precompressed sibling of a file
+            static detail::FileEntryPtr findVariant(
+                const detail::FileEntry& entry,
+                const char* extension,
+                const char* encoding)
+            {
+                auto variant  = std::make_shared<detail::FileEntry>();
+                variant->path = entry.path + extension;
+                if (!detail::statFile(variant->path, variant->stat) ||
+                    variant->stat.directory) {
+                    return nullptr;
+                }
+                detail::describeFile(*variant);
+                variant->mime_type = entry.mime_type;
+                variant->encoding  = encoding;
+                variant->vary      = true;
+                // Distinct from the ETag of the other representations
+                variant->etag.insert(variant->etag.size() - 1,
+                                     std::string("-") + encoding);
+                return variant;
             }
-            nng_stream_send(s_, aio_write_);
-            nng_aio_wait(aio_write_);
-            rv = nng_aio_result(aio_write_);
-            if (rv != 0) {
-                fatal("nng_aio_result", rv);
+
+            static uint64_t variantSize(const detail::FileEntry& entry)
+            {
+                return (entry.brotli ? entry.brotli->stat.size : 0) +
+                       (entry.gzip ? entry.gzip->stat.size : 0);
             }
-        }
-    };
 
-    class ServerImpl : public Server,
-                       public std::enable_shared_from_this<ServerImpl>
-    {
-        std::recursive_mutex handler_mutex_;
-        nng_smart_ptr<nng_http_server> server_{nng_http_server_release};
-        nng_smart_ptr<nng_tls_config> tls_cfg_{nng_tls_config_free};
-        bool started_{false};
-        const bool callback_on_new_thread_{false};
+            static std::shared_ptr<const std::string> readData(
+                const detail::FileEntry& entry)
+            {
+                auto data = std::make_shared<std::string>();
+                if (!detail::readFile(entry.path, *data)) {
+                    return nullptr;
+                }
+                return data;
+            }
 
-        struct route {
-            std::regex reg_exp;
-            std::vector<std::string> uri_param_key;
-            rest::Handler handler;
+            // Load the data of an entry found by find, or nullptr if the
+            // file can't be read
+            static detail::FileEntryPtr load(detail::FileEntryPtr found)
+            {
+                auto entry = std::make_shared<detail::FileEntry>(*found);
+                entry->setData(readData(*entry));
+                return entry->inMemory() ? entry : nullptr;
+            }
+
+            // Find an embedded file, or the index of an embedded directory
+            detail::FileEntryPtr findEmbedded(const std::string& file) const
+            {
+                const auto start = file.find_first_not_of('/');
+                const std::string key =
+                    start == std::string::npos ? "" : file.substr(start);
+                auto it = embedded_files_.find(key);
+                if (it != embedded_files_.end()) {
+                    return it->second;
+                }
+                // Index of a directory
+                const std::string base =
+                    key.empty() || key.back() == '/' ? key : key + "/";
+                if ((it = embedded_files_.find(base + "index.html")) !=
+                        embedded_files_.end() ||
+                    (it = embedded_files_.find(base + "index.htm")) !=
+                        embedded_files_.end()) {
+                    return it->second;
+                }
+                return nullptr;
+            }
+
+            // Entry of an embedded file, or of one of its precompressed
+            // variants
+            static std::shared_ptr<detail::FileEntry> embeddedEntry(
+                const embedded::File& file,
+                const unsigned char* data,
+                size_t size,
+                const char* etag,
+                const char* encoding)
+            {
+                auto entry          = std::make_shared<detail::FileEntry>();
+                entry->path         = file.path;
+                entry->stat.size    = size;
+                entry->mime_type    = detail::mimeType(entry->path);
+                entry->etag         = etag;
+                entry->content      = reinterpret_cast<const char*>(data);
+                entry->content_size = size;
+                if (encoding != nullptr) {
+                    entry->encoding = encoding;
+                    entry->vary     = true;
+                    entry->etag.insert(entry->etag.size() - 1,
+                                       std::string("-") + encoding);
+                }
+                return entry;
+            }
         };
 
+        // A response that never changes, serialized once and written as is
+        // from the nng thread, without any handler call or copy
+        // A directory handler, registered with the server while this lives
         struct directory {
             nng_http_server* server_;
             nng_smart_ptr<nng_http_handler> handler{nng_http_handler_free};
+
             directory(nng_http_server* server,
                       const std::string& uri,
-                      const std::string& path)
+                      std::shared_ptr<directory_state> state)
                 : server_(server)
             {
+                using state_ptr = std::shared_ptr<directory_state>;
+                std::unique_ptr<state_ptr> data(
+                    new state_ptr(std::move(state)));
                 int rv;
-                if ((rv = nng_http_handler_alloc_directory(
-                         &handler, uri.c_str(), path.c_str())) != 0) {
+                if ((rv = nng_http_handler_alloc(
+                         &handler, uri.c_str(), directory_state::handle)) !=
+                    0) {
                     fatal("nng_http_handler_alloc", rv);
                 }
                 if ((rv = nng_http_handler_set_tree(handler)) != 0) {
                     fatal("nng_http_handler_set_tree", rv);
                 }
+                if ((rv = nng_http_handler_set_data(
+                         handler, data.get(), [](void* arg) {
+                             delete (state_ptr*)arg;
+                         })) != 0) {
+                    fatal("nng_http_handler_set_data", rv);
+                }
+                data.release();
                 if ((rv = nng_http_server_add_handler(server_, handler)) != 0) {
                     fatal("nng_http_handler_add_handler", rv);
                 }
             }
+
             ~directory() { nng_http_server_del_handler(server_, handler); }
-            std::map<std::string, std::string> additional_headers;
+        };
+
+        struct static_response {
+            nng_http_server* server_;
+            nng_smart_ptr<nng_http_handler> handler{nng_http_handler_free};
+
+            // All the handler needs, owned by the handler data. nng keeps
+            // the data until the handler is no longer called, so a handler
+            // in progress doesn't depend on this object, which may be
+            // removed meanwhile.
+            struct content {
+                // Status line, headers and body
+                std::string wire;
+                // Size of the status line and headers, all of a HEAD
+                // response
+                size_t head_size;
+                AioPool& aio_pool;
+            };
+            using content_ptr = std::shared_ptr<const content>;
+
+            static_response(nng_http_server* server,
+                            const std::string& method,
+                            const std::string& uri,
+                            HttpStatus status,
+                            const std::map<std::string, std::string>& headers,
+                            const std::string& body,
+                            AioPool& aio_pool)
+                : server_(server)
+            {
+                // Reason phrase as nng would have it
+                nng_http_res* res;
+                int rv;
+                if ((rv = nng_http_res_alloc(&res)) != 0) {
+                    fatal("nng_http_res_alloc", rv);
+                }
+                nng_http_res_set_status(res, static_cast<uint16_t>(status));
+                const std::string reason = nng_http_res_get_reason(res);
+                nng_http_res_free(res);
+
+                std::string wire = "HTTP/1.1 " +
+                                   std::to_string(static_cast<int>(status)) +
+                                   " " + reason + "\r\n";
+                for (const auto& header : headers) {
+                    if (header.first.find_first_of(":\r\n") !=
+                            std::string::npos ||
+                        header.second.find_first_of("\r\n") !=
+                            std::string::npos) {
+                        throw std::invalid_argument("Invalid header: " +
+                                                    header.first);
+                    }
+                    if (isContentLength(header.first)) {
+                        continue;
+                    }
+                    wire += header.first + ": " + header.second + "\r\n";
+                }
+                wire += "Content-Length: " + std::to_string(body.size()) +
+                        "\r\n\r\n";
+                const size_t head_size = wire.size();
+                wire += body;
+                std::unique_ptr<content_ptr> data(new content_ptr(
+                    new content{std::move(wire), head_size, aio_pool}));
+
+                if ((rv = nng_http_handler_alloc(
+                         &handler, uri.c_str(), handle)) != 0) {
+                    fatal("nng_http_handler_alloc", rv);
+                }
+                if ((rv = nng_http_handler_set_method(
+                         handler, method.c_str())) != 0) {
+                    fatal("nng_http_handler_set_method", rv);
+                }
+                // A request body is discarded by nng
+                if ((rv = nng_http_handler_collect_body(
+                         handler, true, 128 * 1024)) != 0) {
+                    fatal("nng_http_handler_collect_body", rv);
+                }
+                if ((rv = nng_http_handler_set_data(
+                         handler, data.get(), [](void* arg) {
+                             delete (content_ptr*)arg;
+                         })) != 0) {
+                    fatal("nng_http_handler_set_data", rv);
+                }
+                data.release();
+                if ((rv = nng_http_server_add_handler(server_, handler)) != 0) {
+                    fatal("nng_http_handler_add_handler", rv);
+                }
+            }
+            ~static_response()
+            {
+                nng_http_server_del_handler(server_, handler);
+            }
+
+            // Content-Length is always set from the body
+            static bool isContentLength(const std::string& name)
+            {
+                static const char content_length[] = "content-length";
+                return name.size() == sizeof(content_length) - 1 &&
+                       std::equal(name.begin(),
+                                  name.end(),
+                                  content_length,
+                                  [](char a, char b) {
+                                      return tolower((unsigned char)a) == b;
+                                  });
+            }
+
+            static void handle(nng_aio* aio)
+            {
+                nng_http_req* req = (nng_http_req*)nng_aio_get_input(aio, 0);
+                nng_http_handler* h =
+                    (nng_http_handler*)nng_aio_get_input(aio, 1);
+                nng_http_conn* conn = (nng_http_conn*)nng_aio_get_input(aio, 2);
+
+                // The response is kept alive until written, should it be
+                // removed meanwhile. Finishing the handler without a
+                // response tells nng the response has been sent.
+                const content_ptr data =
+                    *(content_ptr*)nng_http_handler_get_data(h);
+                auto& pool = data->aio_pool;
+
+                auto tx = pool.acquire([aio, data, &pool](AioPool::Item* tx) {
+                    int rv = nng_aio_result(tx->aio);
+                    pool.release(tx);
+                    nng_aio_set_output(aio, 0, NULL);
+                    nng_aio_finish(aio, rv);
+                });
+                nng_iov iov;
+                iov.iov_buf = (void*)data->wire.data();
+                iov.iov_len =
+                    strcmp(nng_http_req_get_method(req), "HEAD") == 0
+                        ? data->head_size
+                        : data->wire.size();
+                nng_aio_set_iov(tx->aio, 1, &iov);
+                nng_http_conn_write_all(conn, tx->aio);
+            }
+        };
+
+        // Connections of a websocket endpoint. Slots are reused through a
+        // free list, and ids carry the generation of their slot, so the id
+        // of a closed connection never matches a later connection.
+        struct stream_registry {
+            using stream_ptr = std::shared_ptr<StreamInternalImpl>;
+            struct slot {
+                stream_ptr stream;
+                uint32_t generation{0};
+            };
+
+            std::mutex mutex;
+            std::vector<slot> slots;
+            std::vector<uint32_t> free_slots;
+            size_t size{0};
+            // Set once the endpoint is gone
+            bool closed{false};
+            // Serializes the factory calls of the endpoint
+            std::mutex factory_mutex;
+
+            // What connections of the endpoint are set up with
+            const websocket::Factory factory;
+            const std::shared_ptr<const websocket::Options> options;
+            detail::ThreadPool* const workers;
+            // Heartbeats and idle timeouts, nullptr if neither is set
+            detail::TimingWheel* const timers;
+            // Destroys closed connections, which can't be destroyed in
+            // their own nng callbacks
+            detail::ThreadPool& reaper;
+
+            stream_registry(websocket::Factory f,
+                            const websocket::Options& o,
+                            detail::ThreadPool* w,
+                            detail::TimingWheel* t,
+                            detail::ThreadPool& r)
+                : factory(std::move(f))
+                , options(std::make_shared<const websocket::Options>(o))
+                , workers(w)
+                , timers(t)
+                , reaper(r)
+            {
+            }
+
+            // Reserve a slot for a connection. Returns false if full.
+            bool reserve(uint64_t& id)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                const size_t max_size = options->max_num_connections;
+                if (closed || (max_size > 0 && size >= max_size)) {
+                    return false;
+                }
+                uint32_t index;
+                if (free_slots.empty()) {
+                    index = (uint32_t)slots.size();
+                    slots.emplace_back();
+                } else {
+                    index = free_slots.back();
+                    free_slots.pop_back();
+                }
+                ++size;
+                id = ((uint64_t)slots[index].generation << 32) | index;
+                return true;
+            }
+
+            // Set the connection of a reserved slot. Returns false if the
+            // endpoint is gone.
+            bool set(uint64_t id, stream_ptr stream)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (closed) {
+                    return false;
+                }
+                slots[(uint32_t)id].stream = std::move(stream);
+                return true;
+            }
+
+            // Release a slot, the connection is destroyed by the reaper
+            void dispose(uint64_t id)
+            {
+                stream_ptr stream;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    const uint32_t index = (uint32_t)id;
+                    if (closed || index >= slots.size() ||
+                        slots[index].generation != (uint32_t)(id >> 32)) {
+                        // Already released
+                        return;
+                    }
+                    stream = std::move(slots[index].stream);
+                    ++slots[index].generation;
+                    free_slots.push_back(index);
+                    --size;
+                }
+                if (stream) {
+                    // Only the holder is left here, so the last reference is
+                    // dropped on the reaper thread, not in this caller, which
+                    // may be the stream's own receive callback
+                    auto holder =
+                        std::make_shared<stream_ptr>(std::move(stream));
+                    reaper.post([holder] { holder->reset(); });
+                }
+            }
+
+            // Release all slots, returning their connections. No more
+            // connections are added.
+            std::vector<stream_ptr> clear()
+            {
+                std::vector<stream_ptr> streams;
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                for (uint32_t index = 0; index < slots.size(); ++index) {
+                    if (slots[index].stream) {
+                        streams.push_back(std::move(slots[index].stream));
+                        ++slots[index].generation;
+                        free_slots.push_back(index);
+                    }
+                }
+                size = 0;
+                return streams;
+            }
         };
 
         struct web_socket {
-            nng_stream_listener* listener{nullptr};
-            nng_smart_ptr<nng_aio> aio_accept{nng_aio_free};
-            websocket::Factory factory;
-            std::map<int, std::unique_ptr<StreamInternalImpl>> streams;
+            // A pending accept. Several are kept pending, so connections
+            // are accepted in parallel.
+            struct acceptor {
+                web_socket* owner;
+                nng_smart_ptr<nng_aio> aio{nng_aio_free};
+            };
 
-            std::recursive_mutex& mtx;
-            std::future<void> dispose_job;
+            nng_stream_listener* listener{nullptr};
+            std::vector<std::unique_ptr<acceptor>> acceptors;
+            // Shared with the connections, which dispose of themselves
+            std::shared_ptr<stream_registry> streams;
 
             const nng_url* base_url_;
             std::string path_;
             const bool text_mode_;
-            const size_t max_num_connections_;
-            const bool callback_on_new_thread_;
 
             web_socket(const nng_url* base_url,
                        const std::string& path,
                        websocket::Factory f,
-                       std::recursive_mutex& m,
                        const bool text_mode,
-                       const size_t max_num_connections,
-                       const bool callback_on_new_thread)
+                       const websocket::Options& options,
+                       detail::ThreadPool* workers,
+                       detail::TimingWheel* timers,
+                       detail::ThreadPool& reaper)
                 : base_url_(base_url)
                 , path_(path)
-                , factory(f)
-                , mtx(m)
+                , streams(std::make_shared<stream_registry>(
+                      std::move(f), options, workers, timers, reaper))
                 , text_mode_(text_mode)
-                , max_num_connections_(max_num_connections)
-                , callback_on_new_thread_(callback_on_new_thread)
             {
-                int rv;
-                if ((rv = nng_aio_alloc(
-                         &aio_accept,
-                         [](void* arg) { ((web_socket*)arg)->accept_cb(); },
-                         this)) != 0) {
-                    fatal("nng_aio_alloc", rv);
+                const size_t num_accepts = std::max<size_t>(
+                    options.num_pending_accepts, 1);
+                for (size_t i = 0; i < num_accepts; ++i) {
+                    std::unique_ptr<acceptor> a(new acceptor);
+                    a->owner = this;
+                    int rv;
+                    if ((rv = nng_aio_alloc(
+                             &a->aio,
+                             [](void* arg) {
+                                 acceptor* a = (acceptor*)arg;
+                                 a->owner->accept_cb(*a);
+                             },
+                             a.get())) != 0) {
+                        fatal("nng_aio_alloc", rv);
+                    }
+                    acceptors.push_back(std::move(a));
                 }
 
                 startListening();
@@ -383,12 +2229,17 @@ zFX5yAtcD5BnoPBo0CE5y/I=
 
             ~web_socket()
             {
-                {
-                    std::lock_guard<std::recursive_mutex> lock(mtx);
-                    streams.clear();
+                // No more connections accepted
+                nng_stream_listener_close(listener);
+                for (auto& a : acceptors) {
+                    nng_aio_stop(a->aio);
+                }
+                nng_stream_listener_free(listener);
+                // Connections still open live on only until their handlers
+                // are done
+                for (auto& stream : streams->clear()) {
+                    stream->stop();
                 }
-                nng_aio_cancel(aio_accept);
-                stopListening();
             }
 
             void startListening()
@@ -407,6 +2258,13 @@ zFX5yAtcD5BnoPBo0CE5y/I=
                     listener, NNG_OPT_TCP_KEEPALIVE, true);
                 nng_stream_listener_set_size(
                     listener, NNG_OPT_WS_SENDMAXFRAME, 1000000);
+                // Whole messages, reassembled from their frames
+                nng_stream_listener_set_bool(
+                    listener, NNG_OPT_WS_MSGMODE, true);
+                nng_stream_listener_set_size(
+                    listener,
+                    NNG_OPT_RECVMAXSZ,
+                    streams->options->max_message_size);
                 if (text_mode_) {
                     nng_stream_listener_set_bool(
                         listener, NNG_OPT_WS_SEND_TEXT, true);
@@ -415,83 +2273,112 @@ zFX5yAtcD5BnoPBo0CE5y/I=
                 }
 
                 if ((rv = nng_stream_listener_listen(listener)) != 0) {
-                    fatal("nng_stream_listener_alloc_url", rv);
+                    nng_stream_listener_free(listener);
+                    fatal("nng_stream_listener_listen", rv);
                 }
 
-                startAccept();
-            }
-
-            void stopListening()
-            {
-                if (listener != nullptr) {
-                    nng_stream_listener_close(listener);
-                    nng_stream_listener_free(listener);
-                    listener = nullptr;
+                for (auto& a : acceptors) {
+                    startAccept(*a);
                 }
             }
 
-            void startAccept()
+            void startAccept(acceptor& a)
             {
-                nng_stream_listener_accept(listener, aio_accept);
+                nng_stream_listener_accept(listener, a.aio);
             }
 
-            void accept_cb()
+            void accept_cb(acceptor& a)
             {
-                int rv = nng_aio_result(aio_accept);
+                int rv = nng_aio_result(a.aio);
                 if (rv != 0) {
+                    if (rv != NNG_ECLOSED && rv != NNG_ECANCELED) {
+                        // F.i. a failed handshake, keep accepting
+                        startAccept(a);
+                    }
                     return;
                 }
 
-                nng_stream* stream =
-                    (nng_stream*)nng_aio_get_output(aio_accept, 0);
+                nng_stream* stream = (nng_stream*)nng_aio_get_output(a.aio, 0);
+                startAccept(a);
 
-                try {
-                    std::lock_guard<std::recursive_mutex> lock(mtx);
-                    if (max_num_connections_ > 0 &&
-                        (streams.size() + 1) >= max_num_connections_) {
-                        stopListening();
-                    } else {
-                        startAccept();
-                    }
+                uint64_t id;
+                if (!streams->reserve(id)) {
+                    // Over the connection limit. The listener stays up, the
+                    // connection is closed right after the handshake.
+                    nng_stream_free(stream);
+                    return;
+                }
+                // Set up on a worker thread, so accepting carries on while
+                // the factory runs. Bound to the registry rather than the
+                // endpoint, which may be gone by then.
+                std::shared_ptr<stream_registry> registry = streams;
+                auto connect = [registry, id, stream] {
+                    web_socket::connect(registry, id, stream);
+                };
+                auto workers = streams->workers;
+                if (workers == nullptr || !workers->tryPost(connect)) {
+                    connect();
+                }
+            }
 
-                    auto id = streams.empty() ? 1 : streams.rbegin()->first + 1;
-                    auto impl = std::unique_ptr<
-                        StreamInternalImpl>(new StreamInternalImpl(
-                        factory,
+            // Set up an accepted connection, in a reserved slot
+            static void connect(
+                const std::shared_ptr<stream_registry>& registry,
+                uint64_t id,
+                nng_stream* stream)
+            {
+                try {
+                    auto impl = std::make_shared<StreamInternalImpl>(
                         stream,
-                        [id, this](StreamInternalImpl*) {
-                            dispose_job = std::async(std::launch::async, [=] {
-                                std::lock_guard<std::recursive_mutex> lock(mtx);
-                                streams.erase(id);
-                                if (streams.size() < max_num_connections_) {
-                                    startListening();
-                                }
-                            });
+                        [registry, id](StreamInternalImpl*) {
+                            registry->dispose(id);
                         },
-                        callback_on_new_thread_));
-                    streams.insert(std::make_pair(id, std::move(impl)));
+                        registry->workers,
+                        registry->options);
+                    if (!registry->set(id, impl)) {
+                        // Endpoint gone, the stream is freed with impl
+                        return;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(
+                            registry->factory_mutex);
+                        impl->start(registry->factory);
+                    }
+                    if (registry->timers != nullptr) {
+                        registry->timers->add(impl, impl->timerDelay());
+                    }
                 } catch (std::exception&) {
+                    registry->dispose(id);
                 }
             }
         };
 
-        using base_uri_map_t =
-            std::map<std::string,  // Base URI
-                     std::pair<nng_http_handler*, std::map<int, route>>,
-                     std::greater<std::string>>;
+        // NNG handlers, and the number of routes using them
+        using base_uri_map_t = std::map<std::string,  // Base URI
+                                        std::pair<nng_http_handler*, size_t>>;
         std::map<std::string,  // Method
                  base_uri_map_t>
-            routes_;
+            handlers_;
+        std::map<int, route_ptr> routes_;
+        int next_route_id_{1};
+        // Only accessed through std::atomic_load/std::atomic_store
+        std::shared_ptr<const route_table> route_table_{
+            std::make_shared<route_table>()};
         std::map<int, std::unique_ptr<directory>> directories_;
+        std::map<int, std::unique_ptr<static_response>> static_responses_;
         std::map<int, std::unique_ptr<web_socket>> websockets_;
 
         nng_smart_ptr<nng_url> url_{nng_url_free};
 
     public:
-        ServerImpl(const std::string& address,
-                   const bool callback_on_new_thread)
-            : callback_on_new_thread_(callback_on_new_thread)
+        ServerImpl(const std::string& address, const Options& options)
         {
+            if (options.callback_on_worker_thread) {
+                workers_.reset(
+                    new detail::ThreadPool(options.worker_threads,
+                                           options.worker_stack_size,
+                                           options.worker_queue_size));
+            }
             int rv;
             if ((rv = nng_url_parse(&url_, address.c_str())) != 0) {
                 fatal("nng_url_parse", rv);
@@ -517,8 +2404,10 @@ zFX5yAtcD5BnoPBo0CE5y/I=
         ~ServerImpl()
         {
             // If any of these assert, some RouteHolder object is still active
+            assert(handlers_.empty());
             assert(routes_.empty());
             assert(directories_.empty());
+            assert(static_responses_.empty());
             assert(websockets_.empty());
 
             if (server_ != nullptr) {
@@ -530,47 +2419,119 @@ zFX5yAtcD5BnoPBo0CE5y/I=
             }
         }
 
-        void removeRoute(const char* method, const char* base_uri, int id)
+        // Build and publish a new route snapshot. Must be called with
+        // routes_mutex_ held.
+        void publishRoutes()
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
-            auto& method_map  = routes_[method];
-            auto& handler_map = method_map[base_uri];
-            handler_map.second.erase(id);
-            if (!handler_map.second.empty())
-                return;
-            method_map.erase(base_uri);
-            if (!method_map.empty())
-                return;
-            routes_.erase(method);
+            auto table = std::make_shared<route_table>();
+            for (const auto& entry : routes_) {
+                table->routers[entry.second->method].insert(
+                    entry.second->uri, entry.first, entry.second);
+            }
+            std::atomic_store(&route_table_,
+                              std::shared_ptr<const route_table>(table));
+        }
+
+        void removeRoute(const std::string& method,
+                         const std::string& base_uri,
+                         int id)
+        {
+            std::lock_guard<std::recursive_mutex> lock(routes_mutex_);
+            routes_.erase(id);
+            publishRoutes();
+            auto& method_map = handlers_[method];
+            auto handler_it  = method_map.find(base_uri);
+            if (handler_it != method_map.end() &&
+                --handler_it->second.second == 0) {
+                nng_http_server_del_handler(server_, handler_it->second.first);
+                nng_http_handler_free(handler_it->second.first);
+                method_map.erase(handler_it);
+            }
+            if (method_map.empty()) {
+                handlers_.erase(method);
+            }
         }
 
         void removeDirectory(int id)
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
+            std::lock_guard<std::mutex> lock(directories_mutex_);
             auto it = directories_.find(id);
             if (it != directories_.end()) {
                 directories_.erase(it);
             }
         }
 
+        void removeStaticResponse(int id)
+        {
+            std::lock_guard<std::mutex> lock(directories_mutex_);
+            static_responses_.erase(id);
+        }
+
         void removeWebsocket(int id)
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
-            auto it = websockets_.find(id);
-            if (it != websockets_.end()) {
-                websockets_.erase(it);
+            std::unique_ptr<web_socket> socket;
+            {
+                std::lock_guard<std::mutex> lock(websockets_mutex_);
+                auto it = websockets_.find(id);
+                if (it != websockets_.end()) {
+                    socket = std::move(it->second);
+                    websockets_.erase(it);
+                }
             }
+            // Destroyed without the lock, as it waits for pending accepts
+        }
+
+        std::unique_ptr<Token> addRoute(
+            HttpMethod method,
+            const std::string& uri,
+            rest::Handler handler,
+            const rest::RouteOptions& options) override
+        {
+            auto r     = std::make_shared<route>();
+            r->handler = handler;
+            r->options = options;
+            return addRoute(method, uri, r);
+        }
+
+        std::unique_ptr<Token> addAsyncRoute(
+            HttpMethod method,
+            const std::string& uri,
+            rest::AsyncHandler handler,
+            const rest::RouteOptions& options) override
+        {
+            auto r           = std::make_shared<route>();
+            r->async_handler = handler;
+            r->options       = options;
+            return addRoute(method, uri, r);
         }
 
         std::unique_ptr<Token> addRoute(HttpMethod method,
                                         const std::string& uri,
-                                        rest::Handler handler) override
+                                        std::shared_ptr<route> r)
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
-            auto method_str  = method_to_string(method);
-            auto& method_map = routes_[method_str];
+            // readBody waits for the body, which would block an nng thread
+            if (r->options.stream_body && !workers_) {
+                throw std::invalid_argument(
+                    "stream_body requires callback_on_worker_thread");
+            }
+            std::lock_guard<std::recursive_mutex> lock(routes_mutex_);
+            auto method_str = method_to_string(method);
+
+            r->method        = method_str;
+            r->uri           = uri;
+            r->uri_param_key = detail::Router<route_ptr>::parameterNames(uri);
+            const auto id    = next_route_id_++;
+            routes_[id]      = r;
+            try {
+                publishRoutes();
+            } catch (...) {
+                routes_.erase(id);
+                throw;
+            }
+
+            auto& method_map = handlers_[method_str];
             auto base_uri    = uri;
-            auto p           = base_uri.find_first_of(".:");
+            auto p           = base_uri.find_first_of(".:*");
             if (p != std::string::npos) {
                 if (p > 1 && base_uri[p - 1] == '/')
                     --p;
@@ -578,87 +2539,111 @@ zFX5yAtcD5BnoPBo0CE5y/I=
             }
             auto uri_it = method_map.find(base_uri);
             if (uri_it == method_map.end()) {
-                nng_http_handler* handler;
-                int rv = nng_http_handler_alloc(
-                    &handler, base_uri.c_str(), rest_handle);
-                if (rv != 0) {
-                    fatal("nng_http_handler_alloc", rv);
-                }
-                if ((p != std::string::npos) &&
-                    (rv = nng_http_handler_set_tree(handler)) != 0) {
-                    fatal("nng_http_handler_set_tree", rv);
-                }
-                if ((rv = nng_http_handler_set_data(handler, this, NULL)) !=
-                    0) {
-                    fatal("nng_http_handler_set_data", rv);
-                }
-                if ((rv = nng_http_handler_set_method(
-                         handler, method_str.c_str())) != 0) {
-                    fatal("nng_http_handler_set_method", rv);
-                }
-                // We want to collect the body, and we (arbitrarily) limit this
-                // to 128KB.  The default limit is 1MB.  You can explicitly
-                // collect the data yourself with another HTTP read transaction
-                // by disabling this, but that's a lot of work, especially if
-                // you want to handle chunked transfers.
-                if ((rv = nng_http_handler_collect_body(
-                         handler, true, 1024 * 128)) != 0) {
-                    fatal("nng_http_handler_collect_body", rv);
-                }
-                if ((rv = nng_http_server_add_handler(server_, handler)) != 0) {
-                    fatal("nng_http_handler_add_handler", rv);
+                try {
+                    nng_http_handler* handler;
+                    int rv = nng_http_handler_alloc(
+                        &handler, base_uri.c_str(), rest_handle);
+                    if (rv != 0) {
+                        fatal("nng_http_handler_alloc", rv);
+                    }
+                    if ((p != std::string::npos) &&
+                        (rv = nng_http_handler_set_tree(handler)) != 0) {
+                        fatal("nng_http_handler_set_tree", rv);
+                    }
+                    if ((rv = nng_http_handler_set_data(
+                             handler, this, NULL)) != 0) {
+                        fatal("nng_http_handler_set_data", rv);
+                    }
+                    if ((rv = nng_http_handler_set_method(
+                             handler, method_str.c_str())) != 0) {
+                        fatal("nng_http_handler_set_method", rv);
+                    }
+                    // The body is read by rest_handle, as the body limit is
+                    // per route and routes may share a handler
+                    if ((rv = nng_http_handler_collect_body(
+                             handler, false, 0)) != 0) {
+                        fatal("nng_http_handler_collect_body", rv);
+                    }
+                    if ((rv = nng_http_server_add_handler(server_, handler)) !=
+                        0) {
+                        fatal("nng_http_handler_add_handler", rv);
+                    }
+
+                    uri_it = method_map
+                                 .insert(std::make_pair(
+                                     base_uri, std::make_pair(handler, 0)))
+                                 .first;
+                } catch (...) {
+                    routes_.erase(id);
+                    publishRoutes();
+                    if (method_map.empty()) {
+                        handlers_.erase(method_str);
+                    }
+                    throw;
                 }
+            }
+            ++uri_it->second.second;
 
-                method_map[base_uri].first = handler;
-                uri_it                     = method_map.find(base_uri);
-            }
-
-            auto& handler_map = uri_it->second;
-            auto id           = handler_map.second.empty()
-                                    ? 1
-                                    : handler_map.second.rbegin()->first + 1;
-            auto pThis        = shared_from_this();
-
-            route r;
-            std::string uri_re = uri;
-            // Parse URI parameters (starting with ':')
-            const std::regex re_param(":([^/]+)");
-            std::smatch m;
-            while (std::regex_search(uri_re, m, re_param) && m.size() > 1) {
-                r.uri_param_key.push_back(m[1].str());
-
-                // Compute the position of the match within uri_re using
-                // const_iterator to avoid type mismatch errors between const
-                // and non-const iterators. This is particularly important on
-                // ARM platforms, where the standard library (e.g., libstdc++)
-                // enforces stricter type checks and may represent iterators
-                // differently. Avoid subtracting iterators directly, as it may
-                // lead to undefined behavior if the iterator types don't match
-                // exactly or the source string differs.
-                auto pos = std::distance(uri_re.cbegin(), m[0].first);
-
-                // Replace the matched parameter (e.g., ":param-id") with a
-                // regex group that matches any non-slash segment, allowing for
-                // dynamic route matching.
-                uri_re.replace(pos, m[0].length(), "([^/]+)");
-            }
-            std::regex re(uri_re);
-            r.reg_exp = std::move(re);
-            r.handler = handler;
-            handler_map.second.insert(std::make_pair(id, r));
+            auto pThis = shared_from_this();
             return std::unique_ptr<Token>(
                 new RouteTokenImpl([pThis, method_str, base_uri, id] {
-                    pThis->removeRoute(
-                        method_str.c_str(), base_uri.c_str(), id);
+                    pThis->removeRoute(method_str, base_uri, id);
                 }));
         }
 
-        std::unique_ptr<Token> addDirectory(const std::string& uri,
-                                            const std::string& path) override
+        std::unique_ptr<Token> addStaticResponse(
+            HttpMethod method,
+            const std::string& uri,
+            HttpStatus status,
+            const std::map<std::string, std::string>& headers,
+            const std::string& body) override
+        {
+            std::lock_guard<std::mutex> lock(directories_mutex_);
+            auto response = std::unique_ptr<static_response>(
+                new static_response(server_,
+                                    method_to_string(method),
+                                    uri,
+                                    status,
+                                    headers,
+                                    body,
+                                    aio_pool_));
+            auto id = static_responses_.empty()
+                          ? 1
+                          : static_responses_.rbegin()->first + 1;
+            auto pThis            = shared_from_this();
+            static_responses_[id] = std::move(response);
+            return std::unique_ptr<Token>(new RouteTokenImpl(
+                [pThis, id] { pThis->removeStaticResponse(id); }));
+        }
+
+        std::unique_ptr<Token> addDirectory(
+            const std::string& uri,
+            const std::string& path,
+            const DirectoryOptions& options) override
+        {
+            std::lock_guard<std::mutex> lock(directories_mutex_);
+            return insertDirectory(std::unique_ptr<directory>(new directory(
+                server_,
+                uri,
+                std::make_shared<directory_state>(
+                    uri, path, options, aio_pool_, workers_.get()))));
+        }
+
+        std::unique_ptr<Token> addEmbeddedDirectory(
+            const std::string& uri,
+            const embedded::Directory& files,
+            const DirectoryOptions& options) override
+        {
+            std::lock_guard<std::mutex> lock(directories_mutex_);
+            return insertDirectory(std::unique_ptr<directory>(new directory(
+                server_,
+                uri,
+                std::make_shared<directory_state>(
+                    uri, files, options, aio_pool_, workers_.get()))));
+        }
+
+        std::unique_ptr<Token> insertDirectory(std::unique_ptr<directory> dir)
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
-            auto dir =
-                std::unique_ptr<directory>(new directory(server_, uri, path));
             auto id =
                 directories_.empty() ? 1 : directories_.rbegin()->first + 1;
             auto pThis       = shared_from_this();
@@ -672,21 +2657,17 @@ zFX5yAtcD5BnoPBo0CE5y/I=
             websocket::Factory factory,
             const size_t max_num_connections /*= 0 */) override
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
-            auto socket = std::unique_ptr<web_socket>(
-                new web_socket(url_,
-                               uri,
-                               factory,
-                               handler_mutex_,
-                               true,
-                               max_num_connections,
-                               callback_on_new_thread_));
-            auto pThis = shared_from_this();
-            const auto id =
-                websockets_.empty() ? 1 : websockets_.rbegin()->first + 1;
-            websockets_.emplace(std::make_pair(id, std::move(socket)));
-            return std::unique_ptr<Token>(new RouteTokenImpl(
-                [pThis, id] { pThis->removeWebsocket(id); }));
+            websocket::Options options;
+            options.max_num_connections = max_num_connections;
+            return addWebsocket(uri, factory, true, options);
+        }
+
+        std::unique_ptr<Token> addTextWebsocket(
+            const std::string& uri,
+            websocket::Factory factory,
+            const websocket::Options& options) override
+        {
+            return addWebsocket(uri, factory, true, options);
         }
 
         std::unique_ptr<Token> addBinaryWebsocket(
@@ -694,15 +2675,45 @@ zFX5yAtcD5BnoPBo0CE5y/I=
             websocket::Factory factory,
             const size_t max_num_connections /*= 0 */) override
         {
-            std::lock_guard<std::recursive_mutex> lock(handler_mutex_);
+            websocket::Options options;
+            options.max_num_connections = max_num_connections;
+            return addWebsocket(uri, factory, false, options);
+        }
+
+        std::unique_ptr<Token> addBinaryWebsocket(
+            const std::string& uri,
+            websocket::Factory factory,
+            const websocket::Options& options) override
+        {
+            return addWebsocket(uri, factory, false, options);
+        }
+
+        std::unique_ptr<Token> addWebsocket(const std::string& uri,
+                                            websocket::Factory factory,
+                                            const bool text_mode,
+                                            const websocket::Options& options)
+        {
+            std::lock_guard<std::mutex> lock(websockets_mutex_);
+            if (!reaper_) {
+                // One thread, and releasing a connection never waits
+                reaper_.reset(new detail::ThreadPool(
+                    1, 0, std::numeric_limits<size_t>::max()));
+            }
+            const bool timed =
+                sendsHeartbeats(options) || options.idle_timeout_ms > 0;
+            if (timed && !timers_) {
+                // Ticks of 100 ms, a turn of the wheel is 51.2 s
+                timers_.reset(new detail::TimingWheel(100, 512, *reaper_));
+            }
             auto socket = std::unique_ptr<web_socket>(
                 new web_socket(url_,
                                uri,
                                factory,
-                               handler_mutex_,
-                               false,
-                               max_num_connections,
-                               callback_on_new_thread_));
+                               text_mode,
+                               options,
+                               workers_.get(),
+                               timed ? timers_.get() : nullptr,
+                               *reaper_));
             auto pThis = shared_from_this();
             const auto id =
                 websockets_.empty() ? 1 : websockets_.rbegin()->first + 1;
@@ -768,25 +2779,215 @@ zFX5yAtcD5BnoPBo0CE5y/I=
         {
             nng_stream_listener* l = (nng_stream_listener*)arg;
         }
-        static void rest_handle(nng_aio* aio)
+        // A matched REST request, waiting for its handler to be called
+        struct rest_call {
+            ServerImpl* server;
+            route_ptr route;
+            RequestImpl request;
+            ResponseImpl response;
+            rest_call(ServerImpl* s,
+                      route_ptr r,
+                      nng_http_req* req,
+                      nng_http_res* res)
+                : server(s), route(std::move(r)), request(req), response(res)
+            {
+            }
+        };
+
+        // Writes a streamed response body. The next chunk is only requested
+        // once the previous one has been written, so the client paces the
+        // source.
+        class BodyStream
         {
-            nng_http_req* req   = (nng_http_req*)nng_aio_get_input(aio, 0);
-            nng_http_handler* h = (nng_http_handler*)nng_aio_get_input(aio, 1);
-            ServerImpl* pThis   = (ServerImpl*)nng_http_handler_get_data(h);
-            nng_http_res* res;
-            int rv;
+        public:
+            // Send the body source of a handled request
+            static void start(nng_aio* aio,
+                              nng_http_res* res,
+                              std::shared_ptr<rest_call> call)
+            {
+                ServerImpl* server = call->server;
+                const bool close   = !call->request.bodyConsumed();
+                rest::BodySource source = call->response.bodySource();
+                const int64_t length    = call->response.bodyLength();
+                start(aio,
+                      res,
+                      std::move(source),
+                      length,
+                      std::move(call),
+                      server->aio_pool_,
+                      server->workers_.get(),
+                      close);
+            }
 
-            if ((rv = nng_http_res_alloc(&res)) != 0) {
-                nng_aio_finish(aio, rv);
-                return;
+            // Send a body source of the given length (-1 if unknown), with
+            // owner kept alive until done. The source is called on a worker,
+            // if there are workers. With close, the connection is closed once
+            // done.
+            static void start(nng_aio* aio,
+                              nng_http_res* res,
+                              rest::BodySource source,
+                              int64_t length,
+                              std::shared_ptr<const void> owner,
+                              AioPool& pool,
+                              detail::ThreadPool* workers,
+                              bool close)
+            {
+                nng_http_req* req = (nng_http_req*)nng_aio_get_input(aio, 0);
+                const bool head =
+                    strcmp(nng_http_req_get_method(req), "HEAD") == 0;
+                BodyStream* s = new BodyStream(aio,
+                                               res,
+                                               std::move(source),
+                                               length,
+                                               std::move(owner),
+                                               pool);
+                s->workers_ = workers;
+                s->close_   = close;
+                if (s->length_ >= 0) {
+                    nng_http_res_set_header(res,
+                                            "Content-Length",
+                                            std::to_string(s->length_).c_str());
+                } else {
+                    nng_http_res_del_header(res, "Content-Length");
+                    nng_http_res_set_header(
+                        res, "Transfer-Encoding", "chunked");
+                }
+                s->tx_ = s->pool_.acquire([s, head](AioPool::Item* tx) {
+                    int rv = nng_aio_result(tx->aio);
+                    if (rv != 0 || head) {
+                        s->done(rv);
+                    } else {
+                        s->next();
+                    }
+                });
+                nng_http_conn_write_res(s->conn_, res, s->tx_->aio);
             }
-            nng_http_res_set_data(res, NULL, 0);
 
-            try {
-                if (!pThis->handle_rest_request(req, res)) {
-                    nng_http_res_set_status(res, NNG_HTTP_STATUS_NOT_FOUND);
-                    nng_http_res_set_reason(res, NULL);
+        private:
+            nng_aio* aio_;
+            nng_http_res* res_;
+            nng_http_conn* conn_;
+            // Kept alive until written
+            std::shared_ptr<const void> owner_;
+            rest::BodySource source_;
+            int64_t length_;
+            AioPool& pool_;
+            detail::ThreadPool* workers_{nullptr};
+            uint64_t written_{0};
+            std::string chunk_;
+            char chunk_size_[24];
+            bool last_{false};
+            // Close the connection once done
+            bool close_{false};
+            AioPool::Item* tx_{nullptr};
+
+            BodyStream(nng_aio* aio,
+                       nng_http_res* res,
+                       rest::BodySource source,
+                       int64_t length,
+                       std::shared_ptr<const void> owner,
+                       AioPool& pool)
+                : aio_(aio),
+                  res_(res),
+                  conn_((nng_http_conn*)nng_aio_get_input(aio, 2)),
+                  owner_(std::move(owner)),
+                  source_(std::move(source)),
+                  length_(length),
+                  pool_(pool)
+            {
+            }
+
+            void next()
+            {
+                if (workers_ == nullptr ||
+                    !workers_->tryPost([this] { produce(); })) {
+                    produce();
+                }
+            }
+
+            void produce()
+            {
+                bool more = false;
+                chunk_.clear();
+                try {
+                    while ((more = source_(chunk_)) && chunk_.empty()) {
+                    }
+                } catch (...) {
+                    abort();
+                    return;
+                }
+
+                nng_iov iov[3];
+                unsigned niov = 0;
+                if (length_ >= 0) {
+                    // The body must match the announced length
+                    const uint64_t length = static_cast<uint64_t>(length_);
+                    if (written_ + chunk_.size() > length ||
+                        (!more && written_ != length)) {
+                        abort();
+                        return;
+                    }
+                    if (!more) {
+                        done(0);
+                        return;
+                    }
+                    iov[niov].iov_buf   = (void*)chunk_.data();
+                    iov[niov++].iov_len = chunk_.size();
+                } else if (!more) {
+                    static const char end[] = "0\r\n\r\n";
+                    iov[niov].iov_buf       = (void*)end;
+                    iov[niov++].iov_len     = sizeof(end) - 1;
+                    last_                   = true;
+                } else {
+                    static const char crlf[] = "\r\n";
+                    const int n              = snprintf(chunk_size_,
+                                           sizeof(chunk_size_),
+                                           "%llx\r\n",
+                                           (unsigned long long)chunk_.size());
+                    iov[niov].iov_buf        = chunk_size_;
+                    iov[niov++].iov_len      = n;
+                    iov[niov].iov_buf        = (void*)chunk_.data();
+                    iov[niov++].iov_len      = chunk_.size();
+                    iov[niov].iov_buf        = (void*)crlf;
+                    iov[niov++].iov_len      = 2;
                 }
+                written_ += chunk_.size();
+
+                nng_aio_set_iov(tx_->aio, niov, iov);
+                tx_->callback = [this](AioPool::Item* tx) {
+                    int rv = nng_aio_result(tx->aio);
+                    if (rv != 0 || last_) {
+                        done(rv);
+                    } else {
+                        next();
+                    }
+                };
+                nng_http_conn_write_all(conn_, tx_->aio);
+            }
+
+            void done(int rv)
+            {
+                pool_.release(tx_);
+                nng_http_res_free(res_);
+                finishWritten(aio_, rv, close_);
+                delete this;
+            }
+
+            // The status has already been sent, so the only way left to tell
+            // the client something went wrong is to drop the connection.
+            void abort()
+            {
+                close_ = true;
+                done(0);
+            }
+        };
+
+        // Call fn, translating exceptions to HTTP status
+        template <class Fn>
+        static void handleErrors(nng_http_res* res, Fn fn)
+        {
+            try {
+                fn();
             } catch (siesta::Exception& e) {
                 nng_http_res_set_status(res, static_cast<uint16_t>(e.status()));
                 if (!e.has_reason()) {
@@ -801,78 +3002,346 @@ zFX5yAtcD5BnoPBo0CE5y/I=
                                         NNG_HTTP_STATUS_INTERNAL_SERVER_ERROR);
                 nng_http_res_set_reason(res, "Unknown error");
             }
+        }
+
+        static void finishRest(nng_aio* aio, nng_http_res* res)
+        {
             nng_aio_set_output(aio, 0, res);
             nng_aio_finish(aio, 0);
         }
 
-        bool handle_rest_request(nng_http_req* request, nng_http_res* response)
+        // Finish a handler whose response has been written by siesta. nng
+        // reads the next request once the handler is finished, unless the
+        // request asked for close, so a connection with a request body left
+        // on it must be closed here, or the rest of the body would be read as
+        // the next request.
+        static void finishWritten(nng_aio* aio, int rv, bool close)
         {
-            const char* method = nng_http_req_get_method(request);
-            std::unique_lock<std::recursive_mutex> lock(handler_mutex_);
-            auto method_it = routes_.find(method);
-            if (method_it != routes_.end()) {
-                RequestImpl req(request);
-                std::string uri(nng_http_req_get_uri(request));
-                auto q_pos = uri.find('?');
-                if (q_pos != std::string::npos) {
-                    const std::regex r("([^=&]+)=([^=&]+)");
-                    std::smatch m;
-                    std::string::const_iterator searchStart(uri.cbegin() +
-                                                            q_pos + 1);
-                    while (std::regex_search(searchStart, uri.cend(), m, r)) {
-                        req.queries_.insert(
-                            std::make_pair(m[1].str(), m[2].str()));
-                        searchStart = m.suffix().first;
-                    }
-                    uri = uri.substr(0, q_pos);
-                }
-                for (auto& entry : method_it->second) {
-                    auto p = uri.find(entry.first);
-                    if (p != std::string::npos) {
-                        auto& handler_map = entry.second;
-                        for (const auto& entry : handler_map.second) {
-                            std::smatch m;
-                            if (!std::regex_match(
-                                    uri, m, entry.second.reg_exp)) {
-                                continue;
-                            }
-                            if (m.size() > 1) {
-                                if (entry.second.uri_param_key.size() !=
-                                    m.size() - 1) {
-                                    throw std::runtime_error(
-                                        "Uri parameter error");
-                                }
-                                for (size_t i = 1; i < m.size(); ++i) {
-                                    req.uri_parameters_.insert(std::make_pair(
-                                        entry.second.uri_param_key[i - 1],
-                                        m[i].str()));
-                                }
-                            }
-                            void* data = nullptr;
-                            size_t sz  = 0ULL;
-                            nng_http_req_get_data(request, &data, &sz);
-                            if (data != nullptr) {
-                                req.body_.assign((const char*)data, sz);
-                            }
-                            lock.unlock();
-                            ResponseImpl resp(response);
-                            if (callback_on_new_thread_) {
-                                // Call handler within future since threads
-                                // created by nng have rather small stack
-                                // size...
-                                auto f = std::async(std::launch::async, [&] {
-                                    (entry.second.handler)(req, resp);
-                                });
-                                f.get();
-                            } else {
-                                (entry.second.handler)(req, resp);
-                            }
-                            return true;
+            nng_aio_set_output(aio, 0, NULL);
+            if (!close) {
+                nng_aio_finish(aio, rv);
+                return;
+            }
+            nng_http_req* req   = (nng_http_req*)nng_aio_get_input(aio, 0);
+            nng_http_conn* conn = (nng_http_conn*)nng_aio_get_input(aio, 2);
+            // Take the connection, and the request, from the server
+            nng_http_hijack(conn);
+            nng_aio_finish(aio, rv);
+            nng_http_req_free(req);
+            nng_http_conn_close(conn);
+        }
+
+        // Send the response of a handled request
+        static void finishCall(nng_aio* aio,
+                               nng_http_res* res,
+                               const std::shared_ptr<rest_call>& call)
+        {
+            const bool close = !call->request.bodyConsumed();
+            if (close) {
+                // Can't read the next request on the connection
+                nng_http_res_set_header(res, "Connection", "close");
+            }
+            if (call->response.bodySource()) {
+                BodyStream::start(aio, res, call);
+                return;
+            }
+            auto owner = call->response.bodyOwner();
+            if (!owner) {
+                finishRest(aio, res);
+                return;
+            }
+            sendOwned(
+                aio, res, std::move(owner), call->server->aio_pool_, close);
+        }
+
+        // Send a response with a body set by nng_http_res_set_data, which
+        // is kept alive by owner. With close, the connection is closed once
+        // the response is written.
+        static void sendOwned(nng_aio* aio,
+                              nng_http_res* res,
+                              std::shared_ptr<const void> owner,
+                              AioPool& pool,
+                              bool close = false)
+        {
+            nng_http_req* req = (nng_http_req*)nng_aio_get_input(aio, 0);
+            if (strcmp(nng_http_req_get_method(req), "HEAD") == 0) {
+                // nng drops the body, but keeps its Content-Length
+                void* data;
+                size_t size;
+                int rv;
+                nng_http_res_get_data(res, &data, &size);
+                if ((rv = nng_http_res_copy_data(res, data, size)) != 0) {
+                    nng_http_res_free(res);
+                    nng_aio_finish(aio, rv);
+                    return;
+                }
+                finishRest(aio, res);
+                return;
+            }
+
+            // nng doesn't tell when it is done with a response, so write it
+            // here instead, and keep the body alive until it is written.
+            // Finishing the handler without a response tells nng the
+            // response has been sent.
+            nng_http_conn* conn = (nng_http_conn*)nng_aio_get_input(aio, 2);
+            auto tx = pool.acquire(
+                [aio, res, owner, &pool, close](AioPool::Item* tx) {
+                    int rv = nng_aio_result(tx->aio);
+                    pool.release(tx);
+                    nng_http_res_free(res);
+                    finishWritten(aio, rv, close);
+                });
+            nng_http_conn_write_res(conn, res, tx->aio);
+        }
+
+        class CompletionImpl : public rest::Completion
+        {
+            nng_aio* aio_;
+            nng_http_res* res_;
+            // Keeps request and response alive until finished
+            std::shared_ptr<rest_call> call_;
+            std::atomic<bool> done_{false};
+
+        public:
+            CompletionImpl(nng_aio* aio,
+                           nng_http_res* res,
+                           std::shared_ptr<rest_call> call)
+                : aio_(aio), res_(res), call_(std::move(call))
+            {
+            }
+
+            ~CompletionImpl()
+            {
+                fail(HttpStatus::INTERNAL_SERVER_ERROR,
+                     "Request not completed");
+            }
+
+            void finish() override
+            {
+                if (!done_.exchange(true)) {
+                    finishCall(aio_, res_, call_);
+                }
+            }
+
+            void fail(HttpStatus status, const std::string& reason) override
+            {
+                if (!done_.exchange(true)) {
+                    call_->response.clearBody();
+                    nng_http_res_set_status(res_,
+                                            static_cast<uint16_t>(status));
+                    nng_http_res_set_reason(
+                        res_, reason.empty() ? NULL : reason.c_str());
+                    finishCall(aio_, res_, call_);
+                }
+            }
+
+            // Call fn, failing the completion if fn throws
+            template <class Fn>
+            void handleErrors(Fn fn)
+            {
+                try {
+                    fn();
+                } catch (siesta::Exception& e) {
+                    fail(e.status(), e.has_reason() ? e.what() : "");
+                } catch (std::exception& e) {
+                    fail(HttpStatus::INTERNAL_SERVER_ERROR, e.what());
+                } catch (...) {
+                    fail(HttpStatus::INTERNAL_SERVER_ERROR, "Unknown error");
+                }
+            }
+        };
+
+        static void callRest(nng_aio* aio,
+                             nng_http_res* res,
+                             const std::shared_ptr<rest_call>& call)
+        {
+            if (call->route->async_handler) {
+                auto completion =
+                    std::make_shared<CompletionImpl>(aio, res, call);
+                completion->handleErrors([&] {
+                    call->route->async_handler(
+                        call->request, call->response, completion);
+                });
+                return;
+            }
+            handleErrors(res, [&] {
+                call->route->handler(call->request, call->response);
+            });
+            finishCall(aio, res, call);
+        }
+
+        static void rest_handle(nng_aio* aio)
+        {
+            nng_http_req* req   = (nng_http_req*)nng_aio_get_input(aio, 0);
+            nng_http_handler* h = (nng_http_handler*)nng_aio_get_input(aio, 1);
+            ServerImpl* pThis   = (ServerImpl*)nng_http_handler_get_data(h);
+            nng_http_res* res;
+            int rv;
+
+            if ((rv = nng_http_res_alloc(&res)) != 0) {
+                nng_aio_finish(aio, rv);
+                return;
+            }
+            nng_http_res_set_data(res, NULL, 0);
+
+            std::shared_ptr<rest_call> call;
+            handleErrors(res, [&] {
+                call = pThis->match_rest_request(req, res);
+                if (!call) {
+                    nng_http_res_set_status(res, NNG_HTTP_STATUS_NOT_FOUND);
+                    nng_http_res_set_reason(res, NULL);
+                }
+            });
+            if (!call) {
+                const char* length =
+                    nng_http_req_get_header(req, "Content-Length");
+                if (nng_http_req_get_header(req, "Transfer-Encoding") !=
+                        nullptr ||
+                    (length != nullptr && strcmp(length, "0") != 0)) {
+                    // The body is left unread
+                    nng_http_res_set_header(res, "Connection", "close");
+                }
+                finishRest(aio, res);
+                return;
+            }
+
+            const auto& options = call->route->options;
+            std::unique_ptr<BodyReader> reader;
+            try {
+                reader.reset(new BodyReader(req, options.max_body_size));
+            } catch (siesta::Exception& e) {
+                // Don't bother reading the body
+                nng_http_res_set_status(res, static_cast<uint16_t>(e.status()));
+                nng_http_res_set_reason(res, e.has_reason() ? e.what() : NULL);
+                nng_http_res_set_header(res, "Connection", "close");
+                finishRest(aio, res);
+                return;
+            }
+            if (reader->done()) {
+                dispatchRest(aio, res, call);
+            } else if (options.stream_body) {
+                nng_http_conn* conn = (nng_http_conn*)nng_aio_get_input(aio, 2);
+                call->request.streamBody(conn, std::move(reader));
+                dispatchRest(aio, res, call);
+            } else {
+                collectBody(aio, res, call, std::move(reader));
+            }
+        }
+
+        // Call the handler of a request, once its body is available
+        static void dispatchRest(nng_aio* aio,
+                                 nng_http_res* res,
+                                 const std::shared_ptr<rest_call>& call)
+        {
+            auto& workers = call->server->workers_;
+            if (workers == nullptr) {
+                callRest(aio, res, call);
+            } else if (!workers->tryPost(
+                           [aio, res, call] { callRest(aio, res, call); })) {
+                // Worker queue full, aio is finished by the worker otherwise
+                nng_http_res_set_status(res,
+                                        NNG_HTTP_STATUS_SERVICE_UNAVAILABLE);
+                nng_http_res_set_reason(res, NULL);
+                finishCall(aio, res, call);
+            }
+        }
+
+        // Read the body of a request, then call its handler
+        static void collectBody(nng_aio* aio,
+                                nng_http_res* res,
+                                std::shared_ptr<rest_call> call,
+                                std::unique_ptr<BodyReader> reader)
+        {
+            struct collector {
+                nng_aio* aio;
+                nng_http_res* res;
+                std::shared_ptr<rest_call> call;
+                std::unique_ptr<BodyReader> reader;
+                nng_http_conn* conn;
+                std::string body;
+                AioPool* pool;
+                AioPool::Item* rx;
+
+                void read()
+                {
+                    rx->callback = [this](AioPool::Item*) { onRead(); };
+                    reader->read(conn, rx->aio, SIZE_MAX);
+                }
+
+                void onRead()
+                {
+                    int rv = nng_aio_result(rx->aio);
+                    if (rv == 0) {
+                        try {
+                            reader->complete(rx->aio, body);
+                        } catch (siesta::Exception& e) {
+                            nng_http_res_set_status(
+                                res, static_cast<uint16_t>(e.status()));
+                            nng_http_res_set_reason(
+                                res, e.has_reason() ? e.what() : NULL);
+                            nng_http_res_set_header(res, "Connection", "close");
+                            finishRest(aio, res);
+                            done();
+                            return;
                         }
+                        if (!reader->done()) {
+                            read();
+                            return;
+                        }
+                        call->request.setBody(std::move(body));
+                        dispatchRest(aio, res, call);
+                    } else {
+                        // The connection is gone
+                        nng_http_res_free(res);
+                        nng_aio_set_output(aio, 0, NULL);
+                        nng_aio_finish(aio, rv);
                     }
+                    done();
+                }
+
+                void done()
+                {
+                    pool->release(rx);
+                    delete this;
                 }
+            };
+            auto c    = new collector;
+            c->aio    = aio;
+            c->res    = res;
+            c->reader = std::move(reader);
+            c->conn   = (nng_http_conn*)nng_aio_get_input(aio, 2);
+            c->body.reserve(static_cast<size_t>(c->reader->contentLength()));
+            c->pool = &call->server->aio_pool_;
+            c->call = std::move(call);
+            c->rx   = c->pool->acquire(nullptr);
+            c->read();
+        }
+
+        std::shared_ptr<rest_call> match_rest_request(nng_http_req* request,
+                                                      nng_http_res* response)
+        {
+            const char* method = nng_http_req_get_method(request);
+            const auto table   = std::atomic_load(&route_table_);
+            auto method_it     = table->routers.find(method);
+            if (method_it == table->routers.end()) {
+                return nullptr;
             }
-            return false;
+            const auto path = RequestImpl::path(request);
+            detail::Captures captures;
+            const route_ptr* match =
+                method_it->second.match(path.data(), path.size(), captures);
+            if (match == nullptr) {
+                return nullptr;
+            }
+            const route_ptr& r = *match;
+            if (r->uri_param_key.size() != captures.size()) {
+                throw std::runtime_error("Uri parameter error");
+            }
+            auto call =
+                std::make_shared<rest_call>(this, r, request, response);
+            call->request.setUriParameters(r->uri_param_key,
+                                           std::move(captures));
+            return call;
         }
     };  // namespace
 }  // namespace
@@ -926,10 +3395,23 @@ namespace siesta
     {
         std::shared_ptr<siesta::server::Server> createServer(
             const std::string& address,
-            const bool callback_on_new_thread /*= false*/)
+            const bool callback_on_new_thread /*= true*/)
+        {
+            Options options;
+            options.callback_on_worker_thread = callback_on_new_thread;
+            return createServer(address, options);
+        }
+
+        std::shared_ptr<siesta::server::Server> createServer(
+            const std::string& address,
+            const Options& options)
+        {
+            return std::make_shared<ServerImpl>(address, options);
+        }
+
+        std::shared_ptr<websocket::Group> websocket::createGroup()
         {
-            return std::make_shared<ServerImpl>(address,
-                                                callback_on_new_thread);
+            return std::make_shared<GroupImpl>();
         }
     }  // namespace server
 }  // namespace siesta
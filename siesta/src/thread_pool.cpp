@@ -0,0 +1,209 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef WIN32
+#include <process.h>
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <string.h>
+#endif
+
+using siesta::detail::Strand;
+using siesta::detail::ThreadPool;
+
+struct ThreadPool::Worker {
+#ifdef WIN32
+    HANDLE handle{nullptr};
+
+    static unsigned __stdcall entry(void* arg)
+    {
+        static_cast<ThreadPool*>(arg)->run();
+        return 0;
+    }
+
+    Worker(ThreadPool* pool, size_t stack_size)
+    {
+        handle = (HANDLE)_beginthreadex(nullptr,
+                                        static_cast<unsigned>(stack_size),
+                                        entry,
+                                        pool,
+                                        STACK_SIZE_PARAM_IS_A_RESERVATION,
+                                        nullptr);
+        if (handle == nullptr) {
+            throw std::runtime_error("Failed to create worker thread");
+        }
+    }
+
+    void join()
+    {
+        WaitForSingleObject(handle, INFINITE);
+        CloseHandle(handle);
+    }
+#else
+    pthread_t thread;
+
+    static void* entry(void* arg)
+    {
+        static_cast<ThreadPool*>(arg)->run();
+        return nullptr;
+    }
+
+    Worker(ThreadPool* pool, size_t stack_size)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (stack_size > 0) {
+            pthread_attr_setstacksize(&attr, stack_size);
+        }
+        int rv = pthread_create(&thread, &attr, entry, pool);
+        pthread_attr_destroy(&attr);
+        if (rv != 0) {
+            std::stringstream ss;
+            ss << "Failed to create worker thread: " << strerror(rv);
+            throw std::runtime_error(ss.str());
+        }
+    }
+
+    void join() { pthread_join(thread, nullptr); }
+#endif
+};
+
+ThreadPool::ThreadPool(size_t num_threads,
+                       size_t stack_size,
+                       size_t max_queued)
+    : max_queued_(max_queued > 0 ? max_queued : 1)
+{
+    if (num_threads == 0) {
+        num_threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    try {
+        for (size_t i = 0; i < num_threads; ++i) {
+            workers_.emplace_back(new Worker(this, stack_size));
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        not_empty_.notify_all();
+        for (auto& w : workers_) {
+            w->join();
+        }
+        throw;
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+    for (auto& w : workers_) {
+        w->join();
+    }
+}
+
+bool ThreadPool::tryPost(Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.size() >= max_queued_) {
+            return false;
+        }
+        tasks_.push_back(std::move(task));
+    }
+    not_empty_.notify_one();
+    return true;
+}
+
+void ThreadPool::post(Task task)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(
+            lock, [this] { return stopping_ || tasks_.size() < max_queued_; });
+        tasks_.push_back(std::move(task));
+    }
+    not_empty_.notify_one();
+}
+
+void ThreadPool::run()
+{
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock,
+                            [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                // Stopping, and all queued tasks are done
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        not_full_.notify_one();
+        try {
+            task();
+        } catch (...) {
+            // Tasks are expected to handle their own errors
+        }
+    }
+}
+
+size_t Strand::post(Task task)
+{
+    size_t queued;
+    bool start;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+        queued   = tasks_.size();
+        start    = !running_;
+        running_ = true;
+    }
+    if (start) {
+        auto self = shared_from_this();
+        pool_.post([self] { self->run(); });
+    }
+    return queued;
+}
+
+void Strand::run()
+{
+    for (;;) {
+        for (size_t i = 0; i < batch_size; ++i) {
+            Task task;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (tasks_.empty()) {
+                    running_ = false;
+                    return;
+                }
+                task = std::move(tasks_.front());
+            }
+            try {
+                task();
+            } catch (...) {
+                // Tasks are expected to handle their own errors
+            }
+            // Dequeued once done, so the count includes the running task
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.pop_front();
+        }
+        // More to do, after other work waiting for the pool. Carries on
+        // here if the pool queue is full, as a worker mustn't wait for it.
+        auto self = shared_from_this();
+        if (pool_.tryPost([self] { self->run(); })) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace siesta
+{
+    namespace detail
+    {
+        /**
+         * Fixed size pool of worker threads, with a bounded task queue.
+         *
+         * Worker threads are created with a configurable stack size, as
+         * handlers may need (a lot) more stack than the threads created by
+         * nng provide.
+         */
+        class ThreadPool
+        {
+        public:
+            using Task = std::function<void()>;
+
+            /**
+             * @param num_threads   Number of worker threads. Zero means one
+             * per hardware thread.
+             * @param stack_size    Stack size of worker threads. Zero means
+             * platform default.
+             * @param max_queued    Max # of queued (not yet running) tasks.
+             */
+            ThreadPool(size_t num_threads,
+                       size_t stack_size,
+                       size_t max_queued);
+
+            // Runs all queued tasks, then joins the worker threads
+            ~ThreadPool();
+
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+
+            /**
+             * Queue a task, unless the queue is full.
+             *
+             * @returns false if the queue was full
+             */
+            bool tryPost(Task task);
+
+            /**
+             * Queue a task, waiting for room in the queue if it is full.
+             */
+            void post(Task task);
+
+            size_t size() const { return workers_.size(); }
+
+        private:
+            struct Worker;
+
+            void run();
+
+            const size_t max_queued_;
+            std::mutex mutex_;
+            std::condition_variable not_empty_;
+            std::condition_variable not_full_;
+            std::deque<Task> tasks_;
+            bool stopping_{false};
+            std::vector<std::unique_ptr<Worker>> workers_;
+        };
+
+        /**
+         * Runs tasks on a thread pool one at a time, in the order posted,
+         * f.i. the messages of one connection. A strand only occupies a
+         * worker thread while it has tasks to run.
+         */
+        class Strand : public std::enable_shared_from_this<Strand>
+        {
+        public:
+            using Task = ThreadPool::Task;
+
+            explicit Strand(ThreadPool& pool) : pool_(pool) {}
+
+            Strand(const Strand&) = delete;
+            Strand& operator=(const Strand&) = delete;
+
+            /**
+             * Queue a task, to run after all tasks posted before it.
+             *
+             * @returns The number of tasks queued or running, this one
+             * included
+             */
+            size_t post(Task task);
+
+        private:
+            // Tasks run before giving other strands a turn
+            static const size_t batch_size = 16;
+
+            void run();
+
+            ThreadPool& pool_;
+            std::mutex mutex_;
+            std::deque<Task> tasks_;
+            bool running_{false};
+        };
+    }  // namespace detail
+}  // namespace siesta
@@ -0,0 +1,105 @@
+#include "timing_wheel.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+using siesta::detail::TimingWheel;
+
+TimingWheel::TimingWheel(nng_duration resolution,
+                         size_t num_slots,
+                         ThreadPool& reaper)
+    : resolution_(resolution > 0 ? resolution : 1)
+    , reaper_(reaper)
+    , slots_(num_slots > 0 ? num_slots : 1)
+    , start_(nng_clock())
+{
+    int rv = nng_aio_alloc(
+        &aio_, [](void* arg) { static_cast<TimingWheel*>(arg)->tick(); }, this);
+    if (rv != 0) {
+        throw std::runtime_error(std::string("nng_aio_alloc: ") +
+                                 nng_strerror(rv));
+    }
+    schedule();
+}
+
+TimingWheel::~TimingWheel()
+{
+    nng_aio_stop(aio_);
+    nng_aio_free(aio_);
+}
+
+void TimingWheel::add(std::weak_ptr<Client> client, nng_duration delay)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Rounded up, and at least the next tick
+    const uint64_t ticks =
+        delay > resolution_ ? (delay + resolution_ - 1) / resolution_ : 1;
+    const uint64_t due = ticks_ + ticks;
+    slots_[due % slots_.size()].push_back({std::move(client), due});
+}
+
+void TimingWheel::tick()
+{
+    if (nng_aio_result(aio_) != 0) {
+        // Stopped
+        return;
+    }
+    const nng_time now = nng_clock();
+    std::vector<Entry> due;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const uint64_t target = (now - start_) / resolution_;
+        // Catch up on the ticks missed, visiting every slot at most once
+        const uint64_t visits =
+            target > ticks_ ? std::min<uint64_t>(target - ticks_, slots_.size())
+                            : 0;
+        for (uint64_t i = 1; i <= visits; ++i) {
+            auto& slot = slots_[(ticks_ + i) % slots_.size()];
+            for (size_t j = 0; j < slot.size();) {
+                if (slot[j].due <= target) {
+                    due.push_back(std::move(slot[j]));
+                    // Order within a slot doesn't matter
+                    if (j + 1 < slot.size()) {
+                        slot[j] = std::move(slot.back());
+                    }
+                    slot.pop_back();
+                } else {
+                    ++j;
+                }
+            }
+        }
+        if (target > ticks_) {
+            ticks_ = target;
+        }
+    }
+    // Called without the lock, as clients may add themselves again
+    std::vector<std::shared_ptr<Client>> called;
+    for (auto& entry : due) {
+        if (auto client = entry.client.lock()) {
+            const nng_duration delay = client->onTimer(now);
+            if (delay > 0) {
+                add(std::move(entry.client), delay);
+            }
+            called.push_back(std::move(client));
+        }
+    }
+    if (!called.empty()) {
+        auto released =
+            std::make_shared<std::vector<std::shared_ptr<Client>>>(
+                std::move(called));
+        reaper_.post([released] { released->clear(); });
+    }
+    schedule();
+}
+
+void TimingWheel::schedule()
+{
+    nng_time next;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        next = start_ + (ticks_ + 1) * resolution_;
+    }
+    const nng_time now = nng_clock();
+    nng_sleep_aio(next > now ? (nng_duration)(next - now) : 0, aio_);
+}
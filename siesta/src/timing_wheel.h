@@ -0,0 +1,90 @@
+#pragma once
+
+#include <nng/nng.h>
+#include <nng/supplemental/util/platform.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace siesta
+{
+    namespace detail
+    {
+        /**
+         * Hashed timing wheel, for many coarse timers, f.i. the idle
+         * timeouts of connections. A single nng timer turns the wheel, and
+         * a tick only visits the timers in one slot, so its cost doesn't
+         * grow with the number of timers. Timers due more than a turn away
+         * stay in their slot for further turns.
+         */
+        class TimingWheel
+        {
+        public:
+            /** Something with deadlines, called back when one is due */
+            class Client
+            {
+            public:
+                virtual ~Client() = default;
+
+                /**
+                 * Called on an nng thread when due, so it should return
+                 * quickly.
+                 *
+                 * @returns The delay until due again, in ms, or zero for no
+                 * more calls
+                 */
+                virtual nng_duration onTimer(nng_time now) = 0;
+            };
+
+            /**
+             * @param resolution    Tick length, in ms
+             * @param num_slots     Number of slots of the wheel
+             * @param reaper        Releases the clients called back, which
+             * may hold the last reference to one, so its destructor doesn't
+             * hold up the timer
+             */
+            TimingWheel(nng_duration resolution,
+                        size_t num_slots,
+                        ThreadPool& reaper);
+
+            // Clients are no longer called once it returns
+            ~TimingWheel();
+
+            TimingWheel(const TimingWheel&) = delete;
+            TimingWheel& operator=(const TimingWheel&) = delete;
+
+            /**
+             * Add a client, due after a delay in ms. Only a weak reference
+             * is kept, clients that are gone are dropped when due.
+             */
+            void add(std::weak_ptr<Client> client, nng_duration delay);
+
+        private:
+            struct Entry {
+                std::weak_ptr<Client> client;
+                // Tick it is due at
+                uint64_t due;
+            };
+
+            void tick();
+
+            // Sleep until the next tick is due
+            void schedule();
+
+            const nng_duration resolution_;
+            ThreadPool& reaper_;
+            nng_aio* aio_{nullptr};
+            std::mutex mutex_;
+            std::vector<std::vector<Entry>> slots_;
+            // Ticks are counted from the clock, not the timer, which may
+            // fire late
+            const nng_time start_;
+            // Ticks done since started
+            uint64_t ticks_{0};
+        };
+    }  // namespace detail
+}  // namespace siesta
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <nng/nng.h>
+
+#include <cstring>
+
+// Streams in message mode receive whole messages, reassembled from their
+// frames, instead of a stream of bytes without message boundaries. Not in
+// the public nng headers.
+#ifndef NNG_OPT_WS_MSGMODE
+#define NNG_OPT_WS_MSGMODE "ws:msgmode"
+#endif
+
+namespace siesta
+{
+    namespace detail
+    {
+        // Set the message to send with an aio, on a stream in message mode
+        inline int setMessage(nng_aio* aio, const void* data, size_t size)
+        {
+            nng_msg* msg;
+            int rv;
+            if ((rv = nng_msg_alloc(&msg, size)) != 0) {
+                return rv;
+            }
+            if (size > 0) {
+                memcpy(nng_msg_body(msg), data, size);
+            }
+            nng_aio_set_msg(aio, msg);
+            return 0;
+        }
+
+        // Take the message received by an aio, or not consumed by a send,
+        // if any
+        inline nng_msg* takeMessage(nng_aio* aio)
+        {
+            nng_msg* msg = nng_aio_get_msg(aio);
+            nng_aio_set_msg(aio, nullptr);
+            return msg;
+        }
+    }  // namespace detail
+}  // namespace siesta
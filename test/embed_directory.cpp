@@ -0,0 +1,43 @@
+#include <gtest/gtest.h>
+#include <siesta/embedded.h>
+
+#include <string.h>
+
+#include <map>
+#include <string>
+
+// Generated from embedded_www by siesta_embed_directory
+#include "test_assets.h"
+
+using namespace siesta;
+
+TEST(siesta, embed_directory)
+{
+    const embedded::Directory& directory = test_assets();
+    std::map<std::string, const embedded::File*> files;
+    for (size_t i = 0; i < directory.count; ++i) {
+        files[directory.files[i].path] = &directory.files[i];
+    }
+
+    // Precompressed siblings are variants, but a compressed file of its own
+    // is embedded as it is
+    EXPECT_EQ(files.size(), 2u);
+    EXPECT_EQ(files.count("index.html.gz"), 0u);
+    ASSERT_EQ(files.count("index.html"), 1u);
+    ASSERT_EQ(files.count("data.tar.gz"), 1u);
+
+    const embedded::File* index = files["index.html"];
+    EXPECT_EQ(strncmp(reinterpret_cast<const char*>(index->data),
+                      "<!DOCTYPE html>",
+                      15),
+              0);
+    EXPECT_NE(index->gzip_data, nullptr);
+    EXPECT_LT(index->gzip_size, index->size);
+
+    // Gzip magic
+    const embedded::File* archive = files["data.tar.gz"];
+    ASSERT_GE(archive->size, 2u);
+    EXPECT_EQ(archive->data[0], 0x1f);
+    EXPECT_EQ(archive->data[1], 0x8b);
+    EXPECT_EQ(archive->etag[0], '"');
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+// Helpers for tests that need to see HTTP on the wire
+
+#include <nng/nng.h>
+
+#include <ctype.h>
+
+#include <algorithm>
+#include <string>
+
+namespace
+{
+    // Send raw bytes on a new connection, and return everything received
+    // until the server closes it, or nothing arrives for a second
+    inline std::string rawExchange(const char* url, const std::string& request)
+    {
+        nng_stream_dialer* dialer = nullptr;
+        nng_stream* stream        = nullptr;
+        nng_aio* aio              = nullptr;
+        std::string received;
+        if (nng_stream_dialer_alloc(&dialer, url) != 0 ||
+            nng_aio_alloc(&aio, NULL, NULL) != 0) {
+            nng_stream_dialer_free(dialer);
+            return received;
+        }
+        nng_aio_set_timeout(aio, 1000);
+        nng_stream_dialer_dial(dialer, aio);
+        nng_aio_wait(aio);
+        if (nng_aio_result(aio) == 0) {
+            stream = (nng_stream*)nng_aio_get_output(aio, 0);
+            nng_iov iov;
+            iov.iov_buf = (void*)request.data();
+            iov.iov_len = request.size();
+            nng_aio_set_iov(aio, 1, &iov);
+            nng_stream_send(stream, aio);
+            nng_aio_wait(aio);
+            char buf[4096];
+            iov.iov_buf = buf;
+            iov.iov_len = sizeof(buf);
+            nng_aio_set_iov(aio, 1, &iov);
+            for (;;) {
+                nng_stream_recv(stream, aio);
+                nng_aio_wait(aio);
+                if (nng_aio_result(aio) != 0) {
+                    break;
+                }
+                received.append(buf, nng_aio_count(aio));
+            }
+            nng_stream_free(stream);
+        }
+        nng_aio_free(aio);
+        nng_stream_dialer_free(dialer);
+        return received;
+    }
+
+    inline size_t countOf(const std::string& s, const char* what)
+    {
+        size_t n = 0;
+        for (size_t pos = 0; (pos = s.find(what, pos)) != std::string::npos;
+             ++pos) {
+            ++n;
+        }
+        return n;
+    }
+
+    // Value of a header of a raw response, empty if not present
+    inline std::string headerValue(const std::string& response,
+                                   const char* name)
+    {
+        const std::string key = std::string("\r\n") + name + ":";
+        auto it = std::search(response.begin(),
+                              response.end(),
+                              key.begin(),
+                              key.end(),
+                              [](char a, char b) {
+                                  return tolower((unsigned char)a) ==
+                                         tolower((unsigned char)b);
+                              });
+        if (it == response.end()) {
+            return std::string();
+        }
+        size_t pos = (it - response.begin()) + key.size();
+        while (pos < response.size() && response[pos] == ' ') {
+            ++pos;
+        }
+        return response.substr(pos, response.find("\r\n", pos) - pos);
+    }
+}  // namespace
@@ -2,6 +2,13 @@
 #include <siesta/client.h>
 #include <siesta/server.h>
 
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include "raw_http.h"
+
 using namespace siesta;
 
 TEST(siesta, server_ok)
@@ -152,3 +159,489 @@ TEST(siesta, server_uri_parameters)
         EXPECT_TRUE(false) << e.what();
     }
 }
+
+TEST(siesta, server_uri_wildcard)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::GET,
+            "/files/*path",
+            [](const server::rest::Request& req, server::rest::Response& resp) {
+                resp.setBody(req.getUriParameters().at("path"));
+            }));
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::GET,
+            "/files/:name/info",
+            [](const server::rest::Request& req, server::rest::Response& resp) {
+                resp.setBody("info:" + req.getUriParameters().at("name"));
+            }));
+
+    auto f = client::getRequest("http://127.0.0.1:8080/files/a/b/c.txt",
+                                client::Headers(),
+                                5000);
+    std::string result;
+    EXPECT_NO_THROW(result = f.get());
+    EXPECT_EQ(result, "a/b/c.txt");
+
+    // More specific route wins over the wildcard
+    f = client::getRequest(
+        "http://127.0.0.1:8080/files/a/info", client::Headers(), 5000);
+    EXPECT_NO_THROW(result = f.get());
+    EXPECT_EQ(result, "info:a");
+}
+
+TEST(siesta, server_queries_decoded)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::GET,
+            "/my/test/path",
+            [](const server::rest::Request& req, server::rest::Response& resp) {
+                std::stringstream ss;
+                for (const auto& q : req.getQueryList()) {
+                    ss << q.first << "=" << q.second << ";";
+                }
+                ss << req.getQueries().at("tag");
+                resp.setBody(ss.str());
+            }));
+
+    auto f = client::getRequest(
+        "http://127.0.0.1:8080/my/test/path?name=a%20b+c&flag&tag=1&tag=2",
+        client::Headers(),
+        5000);
+
+    std::string result;
+    EXPECT_NO_THROW(result = f.get());
+    EXPECT_EQ(result, "name=a b c;flag=;tag=1;tag=2;1");
+}
+
+TEST(siesta, server_worker_threads)
+{
+    server::Options options;
+    options.worker_threads    = 2;
+    options.worker_stack_size = 16 * 1024 * 1024;
+
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(
+        server = server::createServer("http://127.0.0.1:8080", options));
+    EXPECT_NO_THROW(server->start());
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::GET,
+            "/deep",
+            [](const server::rest::Request&, server::rest::Response& resp) {
+                // Would overflow the stack of an nng thread
+                char buffer[4 * 1024 * 1024];
+                memset(buffer, 'x', sizeof(buffer));
+                resp.setBody(std::string(buffer, 16));
+            }));
+
+    std::vector<client::Response> responses;
+    for (int i = 0; i < 8; ++i) {
+        responses.push_back(client::getRequest(
+            "http://127.0.0.1:8080/deep", client::Headers(), 5000));
+    }
+    for (auto& f : responses) {
+        std::string result;
+        EXPECT_NO_THROW(result = f.get());
+        EXPECT_EQ(result, std::string(16, 'x'));
+    }
+}
+
+TEST(siesta, server_async_route)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    std::vector<std::thread> threads;
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addAsyncRoute(
+            siesta::HttpMethod::POST,
+            "/my/:result",
+            [&threads](const server::rest::Request& req,
+                       server::rest::Response& resp,
+                       std::shared_ptr<server::rest::Completion> completion) {
+                // Respond later, from another thread
+                threads.emplace_back([&req, &resp, completion] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    if (req.getUriParameters().at("result") == "ok") {
+                        resp.setBody(req.getBody());
+                        completion->finish();
+                    } else {
+                        completion->fail(siesta::HttpStatus::CONFLICT);
+                    }
+                });
+            }));
+
+    std::string req_body("{33F949DE-ED30-450C-B903-670EFF210D08}");
+    auto f = client::postRequest(
+        "http://127.0.0.1:8080/my/ok", req_body, "", client::Headers(), 5000);
+    std::string result;
+    EXPECT_NO_THROW(result = f.get());
+    EXPECT_EQ(result, req_body);
+
+    f = client::postRequest(
+        "http://127.0.0.1:8080/my/fail", req_body, "", client::Headers(), 5000);
+    try {
+        f.get();
+        EXPECT_TRUE(false) << "Should not come here!";
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::CONFLICT);
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+TEST(siesta, server_request_views)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::POST,
+            "/my/:test/path",
+            [](const server::rest::Request& req, server::rest::Response& resp) {
+                std::stringstream ss;
+                ss << req.getUriView().str() << ";";
+                ss << req.getPathView().str() << ";";
+                ss << req.getUriParameterView("test").str() << ";";
+                ss << req.getUriParameterView("none").empty() << ";";
+                ss << req.getHeaderView("X-Test").str() << ";";
+                ss << (req.getBodyView() == req.getBody());
+                resp.setBody(ss.str());
+            }));
+
+    client::Headers headers;
+    headers.push_back(std::make_pair("X-Test", "hdr"));
+    auto f = client::postRequest(
+        "http://127.0.0.1:8080/my/value/path?a=1", "body", "", headers, 5000);
+
+    std::string result;
+    EXPECT_NO_THROW(result = f.get());
+    EXPECT_EQ(result, "/my/value/path?a=1;/my/value/path;value;1;hdr;1");
+}
+
+TEST(siesta, server_owned_body)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    auto payload = std::make_shared<const std::string>(1 << 20, 'p');
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::GET,
+            "/:kind",
+            [&](const server::rest::Request& req,
+                server::rest::Response& resp) {
+                auto kind = req.getUriParameters().at("kind");
+                if (kind == "string") {
+                    std::string body("moved string");
+                    resp.setBody(std::move(body));
+                } else if (kind == "vector") {
+                    std::vector<uint8_t> body{'b', 'y', 't', 'e', 's'};
+                    resp.setBody(std::move(body));
+                } else {
+                    resp.setBody(payload);
+                }
+            }));
+
+    const std::string url = "http://127.0.0.1:8080/";
+    EXPECT_EQ(client::getRequest(url + "string", {}, 5000).get(),
+              "moved string");
+    EXPECT_EQ(client::getRequest(url + "vector", {}, 5000).get(), "bytes");
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(client::getRequest(url + "payload", {}, 5000).get(),
+                  *payload);
+    }
+}
+
+TEST(siesta, server_streamed_body)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    const int chunks     = 100;
+    const int chunk_size = 1000;
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::GET,
+            "/:mode",
+            [&](const server::rest::Request& req,
+                server::rest::Response& resp) {
+                auto count  = std::make_shared<int>(0);
+                auto source = [count](std::string& chunk) {
+                    if (*count == chunks) {
+                        return false;
+                    }
+                    chunk.assign(chunk_size, char('a' + (*count)++ % 26));
+                    return true;
+                };
+                if (req.getUriParameters().at("mode") == "chunked") {
+                    resp.setBodySource(source);
+                } else {
+                    resp.setBodySource(source, chunks * chunk_size);
+                }
+            }));
+
+    std::string expected;
+    for (int i = 0; i < chunks; ++i) {
+        expected.append(chunk_size, char('a' + i % 26));
+    }
+    const std::string url = "http://127.0.0.1:8080/";
+    std::string result;
+    EXPECT_NO_THROW(
+        result = client::getRequest(url + "chunked", {}, 5000).get());
+    EXPECT_EQ(result, expected);
+    EXPECT_NO_THROW(
+        result = client::getRequest(url + "length", {}, 5000).get());
+    EXPECT_EQ(result, expected);
+}
+
+TEST(siesta, server_body_limit)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::rest::RouteOptions options;
+    options.max_body_size = 1024;
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::POST,
+            "/limited",
+            [](const server::rest::Request& req, server::rest::Response& resp) {
+                resp.setBody(std::to_string(req.getBody().size()));
+            },
+            options));
+
+    const std::string url = "http://127.0.0.1:8080/limited";
+    EXPECT_EQ(client::postRequest(url, std::string(1024, 'x'), "").get(),
+              "1024");
+    try {
+        auto r = client::postRequest(url, std::string(2048, 'x'), "").get();
+        EXPECT_TRUE(false);
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::PAYLOAD_TOO_LARGE);
+    }
+}
+
+TEST(siesta, server_streamed_request_body)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::rest::RouteOptions options;
+    options.max_body_size = 4 * 1024 * 1024;
+    options.stream_body   = true;
+
+    std::atomic<size_t> largest_read{0};
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::POST,
+            "/upload",
+            [&](const server::rest::Request& req,
+                server::rest::Response& resp) {
+                EXPECT_TRUE(req.getBody().empty());
+                char buf[4096];
+                size_t total = 0;
+                size_t n;
+                while ((n = req.readBody(buf, sizeof(buf))) > 0) {
+                    total += n;
+                    if (n > largest_read) {
+                        largest_read = n;
+                    }
+                }
+                resp.setBody(std::to_string(total));
+            },
+            options));
+
+    const std::string body(3 * 1024 * 1024, 'x');
+    std::string result;
+    EXPECT_NO_THROW(result = client::postRequest(
+                                 "http://127.0.0.1:8080/upload", body, "")
+                                 .get());
+    EXPECT_EQ(result, std::to_string(body.size()));
+    EXPECT_LE(largest_read, 4096u);
+}
+
+TEST(siesta, server_static_response)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(TokenHolder += server->addStaticResponse(
+                        siesta::HttpMethod::GET,
+                        "/health",
+                        siesta::HttpStatus::OK,
+                        {{"Content-Type", "application/json"}},
+                        "{\"status\":\"up\"}"));
+    auto unavailable = server->addStaticResponse(
+        siesta::HttpMethod::GET,
+        "/maintenance",
+        siesta::HttpStatus::SERVICE_UNAVAILABLE,
+        {},
+        "down");
+
+    const std::string url = "http://127.0.0.1:8080/";
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(client::getRequest(url + "health", {}, 5000).get(),
+                  "{\"status\":\"up\"}");
+    }
+    try {
+        auto r = client::getRequest(url + "maintenance", {}, 5000).get();
+        EXPECT_TRUE(false);
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::SERVICE_UNAVAILABLE);
+    }
+
+    unavailable.reset();
+    try {
+        auto r = client::getRequest(url + "maintenance", {}, 5000).get();
+        EXPECT_TRUE(false);
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::NOT_FOUND);
+    }
+
+    EXPECT_THROW(auto t = server->addStaticResponse(siesta::HttpMethod::GET,
+                                                    "/bad",
+                                                    siesta::HttpStatus::OK,
+                                                    {{"X-Bad", "a\r\nb"}},
+                                                    ""),
+                 std::invalid_argument);
+}
+
+TEST(siesta, server_unread_body_closes)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::rest::RouteOptions options;
+    options.stream_body = true;
+
+    std::atomic<int> smuggled{0};
+    std::atomic<size_t> read_total{0};
+    server::TokenHolder TokenHolder;
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::POST,
+            "/ignore/:mode",
+            [](const server::rest::Request& req,
+               server::rest::Response& resp) {
+                // Leaves the body on the connection
+                if (req.getUriParameters().at("mode") == "source") {
+                    auto sent = std::make_shared<bool>(false);
+                    resp.setBodySource([sent](std::string& chunk) {
+                        if (*sent) {
+                            return false;
+                        }
+                        chunk = "ignored";
+                        return *sent = true;
+                    });
+                } else {
+                    resp.setBody(std::string("ignored"));
+                }
+            },
+            options));
+    EXPECT_NO_THROW(
+        TokenHolder += server->addRoute(
+            siesta::HttpMethod::POST,
+            "/read",
+            [&](const server::rest::Request& req,
+                server::rest::Response& resp) {
+                char buf[7];
+                size_t n;
+                while ((n = req.readBody(buf, sizeof(buf))) > 0) {
+                    read_total += n;
+                }
+                resp.setBody(std::string("read"));
+            },
+            options));
+    EXPECT_NO_THROW(TokenHolder += server->addRoute(
+                        siesta::HttpMethod::GET,
+                        "/smuggled",
+                        [&](const server::rest::Request&,
+                            server::rest::Response& resp) {
+                            ++smuggled;
+                            resp.setBody(std::string("smuggled"));
+                        }));
+
+    // The body of the first request holds a second one, which must not be
+    // taken as the next request on the connection
+    const std::string inner =
+        "GET /smuggled HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    for (const char* mode : {"owned", "source"}) {
+        const std::string request =
+            std::string("POST /ignore/") + mode +
+            " HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: " +
+            std::to_string(inner.size()) + "\r\n\r\n" + inner;
+        const std::string received =
+            rawExchange("tcp://127.0.0.1:8080", request);
+        EXPECT_EQ(countOf(received, "HTTP/1.1 "), 1u) << mode;
+        EXPECT_EQ(countOf(received, "ignored"), 1u) << mode;
+    }
+    EXPECT_EQ(smuggled, 0);
+
+    // A chunked body read to its end leaves the connection usable
+    const std::string request =
+        "POST /read HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n"
+        "5\r\nhello\r\n1;ext=1\r\n \r\n5\r\nworld\r\n0\r\n\r\n" +
+        inner;
+    const std::string received =
+        rawExchange("tcp://127.0.0.1:8080", request);
+    EXPECT_EQ(countOf(received, "HTTP/1.1 200"), 2u);
+    EXPECT_EQ(read_total, 11u);
+    EXPECT_EQ(smuggled, 1);
+}
+
+TEST(siesta, server_streamed_body_needs_workers)
+{
+    server::Options server_options;
+    server_options.callback_on_worker_thread = false;
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(
+        server = server::createServer("http://127.0.0.1:8080", server_options));
+
+    server::rest::RouteOptions options;
+    options.stream_body = true;
+    EXPECT_THROW(auto t = server->addRoute(
+                     siesta::HttpMethod::POST,
+                     "/upload",
+                     [](const server::rest::Request&,
+                        server::rest::Response&) {},
+                     options),
+                 std::invalid_argument);
+}
@@ -8,6 +8,8 @@ namespace fs = ghc::filesystem;
 
 #include <string.h>
 
+#include "raw_http.h"
+
 namespace
 {
     constexpr auto j =
@@ -35,8 +37,10 @@ namespace
         }
         ~TempFile()
         {
+            // Directories shared with other files are left in place
+            std::error_code ec;
             while (!fs::equivalent(file, fs::temp_directory_path())) {
-                fs::remove(file);
+                fs::remove(file, ec);
                 file = file.parent_path();
             }
         }
@@ -88,3 +92,288 @@ TEST(siesta, serve_non_root_uri)
     EXPECT_NO_THROW(result = f.get());
     EXPECT_EQ(result, j);
 }
+
+TEST(siesta, serve_cached_directory)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    TempFile cached("cachedir/page.html", "first", 5);
+
+    server::DirectoryOptions options;
+    options.cache = true;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addDirectory("/cached",
+                                                   cached.directory(),
+                                                   options));
+    EXPECT_NO_THROW(holder += server->addDirectory("/uncached",
+                                                   cached.directory()));
+
+    const std::string url = "http://127.0.0.1:8080/";
+    std::string result;
+    EXPECT_NO_THROW(
+        result = client::getRequest(url + "cached/" + cached.path()).get());
+    EXPECT_EQ(result, "first");
+
+    // Served from memory, without looking at the file again
+    std::ofstream(cached.file, std::ios_base::trunc | std::ios_base::binary)
+        << "second";
+    EXPECT_NO_THROW(
+        result = client::getRequest(url + "cached/" + cached.path()).get());
+    EXPECT_EQ(result, "first");
+    EXPECT_NO_THROW(
+        result = client::getRequest(url + "uncached/" + cached.path()).get());
+    EXPECT_EQ(result, "second");
+
+    try {
+        auto r = client::getRequest(url + "cached/missing.html").get();
+        EXPECT_TRUE(false);
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::NOT_FOUND);
+    }
+}
+
+TEST(siesta, serve_not_modified)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::DirectoryOptions options;
+    options.cache_control = "max-age=60";
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(
+        holder += server->addDirectory("/", file.directory(), options));
+
+    const std::string url = "http://127.0.0.1:8080/" + file.path();
+    auto expectNotModified = [&](const char* key, const char* value) {
+        client::Headers headers;
+        headers.push_back(std::make_pair(key, value));
+        try {
+            auto r = client::getRequest(url, headers).get();
+            EXPECT_TRUE(false);
+        } catch (siesta::Exception& e) {
+            EXPECT_EQ(e.status(), siesta::HttpStatus::NOT_MODIFIED);
+        }
+    };
+    expectNotModified("If-None-Match", "*");
+    expectNotModified("If-Modified-Since", "Fri, 01 Jan 2100 00:00:00 GMT");
+
+    // The ETag of a response brings a 304 when sent back, and both carry
+    // the caching headers
+    const std::string request = "GET /" + file.path() +
+                                " HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                                "Connection: close\r\n";
+    const std::string ok =
+        rawExchange("tcp://127.0.0.1:8080", request + "\r\n");
+    EXPECT_EQ(ok.compare(0, 12, "HTTP/1.1 200"), 0);
+    EXPECT_EQ(headerValue(ok, "Cache-Control"), "max-age=60");
+    const std::string etag = headerValue(ok, "ETag");
+    EXPECT_FALSE(etag.empty());
+    const std::string not_modified =
+        rawExchange("tcp://127.0.0.1:8080",
+                    request + "If-None-Match: " + etag + "\r\n\r\n");
+    EXPECT_EQ(not_modified.compare(0, 12, "HTTP/1.1 304"), 0);
+    EXPECT_EQ(headerValue(not_modified, "ETag"), etag);
+    EXPECT_EQ(headerValue(not_modified, "Cache-Control"), "max-age=60");
+    expectNotModified("If-None-Match", etag.c_str());
+
+    client::Headers headers;
+    headers.push_back(
+        std::make_pair("If-Modified-Since", "Thu, 01 Jan 1970 00:00:00 GMT"));
+    std::string result;
+    EXPECT_NO_THROW(result = client::getRequest(url, headers).get());
+    EXPECT_EQ(result, j);
+
+    headers.clear();
+    headers.push_back(std::make_pair("If-None-Match", "\"other\""));
+    EXPECT_NO_THROW(result = client::getRequest(url, headers).get());
+    EXPECT_EQ(result, j);
+}
+
+TEST(siesta, serve_byte_ranges)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::DirectoryOptions cached;
+    cached.cache = true;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addDirectory("/disk", file.directory()));
+    EXPECT_NO_THROW(
+        holder += server->addDirectory("/memory", file.directory(), cached));
+
+    const std::string content(j);
+    for (auto dir : {"disk", "memory"}) {
+        const std::string url =
+            std::string("http://127.0.0.1:8080/") + dir + "/" + file.path();
+        auto get = [&](const char* range) {
+            client::Headers headers;
+            headers.push_back(std::make_pair("Range", range));
+            return client::getRequest(url, headers).get();
+        };
+        // Load into the cache
+        EXPECT_EQ(client::getRequest(url).get(), content);
+
+        EXPECT_EQ(get("bytes=2-7"), content.substr(2, 6));
+        EXPECT_EQ(get("bytes=10-"), content.substr(10));
+        EXPECT_EQ(get("bytes=-5"), content.substr(content.size() - 5));
+
+        const std::string multi = get("bytes=-1,0-0");
+        auto firstLine = [](const std::string& body) {
+            return body.substr(0, body.find("\r\n"));
+        };
+        const std::string boundary = firstLine(multi);
+        EXPECT_EQ(boundary.compare(0, 9, "--siesta-"), 0);
+        // In the order of the file
+        EXPECT_LT(multi.find("Content-Range: bytes 0-0/"),
+                  multi.find("Content-Range: bytes " +
+                             std::to_string(content.size() - 1)));
+        EXPECT_EQ(multi.substr(multi.size() - boundary.size() - 4),
+                  boundary + "--\r\n");
+        // Every response gets its own boundary
+        EXPECT_NE(firstLine(get("bytes=0-0,-1")), boundary);
+
+        // Overlapping and adjacent ranges are sent as one
+        EXPECT_EQ(get("bytes=0-3,2-5"), content.substr(0, 6));
+        EXPECT_EQ(get("bytes=3-5,0-2"), content.substr(0, 6));
+        EXPECT_EQ(get("bytes=0-,0-,0-"), content);
+
+        // Malformed ranges are ignored
+        EXPECT_EQ(get("bytes=7-2"), content);
+
+        try {
+            auto r = get("bytes=100000-");
+            EXPECT_TRUE(false);
+        } catch (siesta::Exception& e) {
+            EXPECT_EQ(e.status(), siesta::HttpStatus::RANGE_NOT_SATISFIABLE);
+        }
+    }
+}
+
+TEST(siesta, serve_precompressed)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    // The server doesn't look into the files
+    TempFile plain("encdir/app.js", "plain", 5);
+    TempFile gzipped("encdir/app.js.gz", "gzipped", 7);
+
+    server::DirectoryOptions cached;
+    cached.cache = true;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder +=
+                    server->addDirectory("/disk", plain.directory()));
+    EXPECT_NO_THROW(
+        holder += server->addDirectory("/memory", plain.directory(), cached));
+
+    for (auto dir : {"disk", "memory"}) {
+        const std::string url =
+            std::string("http://127.0.0.1:8080/") + dir + "/" + plain.path();
+        auto get = [&](const char* accept) {
+            client::Headers headers;
+            headers.push_back(std::make_pair("Accept-Encoding", accept));
+            return client::getRequest(url, headers).get();
+        };
+        EXPECT_EQ(client::getRequest(url).get(), "plain");
+        EXPECT_EQ(get("gzip, deflate, br"), "gzipped");
+        EXPECT_EQ(get("br"), "plain");
+        EXPECT_EQ(get("gzip;q=0"), "plain");
+    }
+}
+
+TEST(siesta, serve_embedded)
+{
+    static const char index_data[] = "embedded index";
+    static const char app_data[]   = "plain";
+    static const char app_gzip[]   = "gzipped";
+    static const embedded::File files[] = {
+        {"index.html",
+         reinterpret_cast<const unsigned char*>(index_data),
+         strlen(index_data),
+         "\"index\"",
+         nullptr,
+         0,
+         nullptr,
+         0},
+        {"js/app.js",
+         reinterpret_cast<const unsigned char*>(app_data),
+         strlen(app_data),
+         "\"app\"",
+         reinterpret_cast<const unsigned char*>(app_gzip),
+         strlen(app_gzip),
+         nullptr,
+         0},
+    };
+
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addEmbeddedDirectory(
+                        "/embedded", embedded::Directory{files, 2}));
+
+    const std::string url = "http://127.0.0.1:8080/embedded/";
+    auto get = [&](const std::string& file,
+                   const char* key,
+                   const char* value) {
+        client::Headers headers;
+        headers.push_back(std::make_pair(key, value));
+        return client::getRequest(url + file, headers).get();
+    };
+    EXPECT_EQ(client::getRequest(url).get(), index_data);
+    EXPECT_EQ(client::getRequest(url + "index.html").get(), index_data);
+    EXPECT_EQ(client::getRequest(url + "js/app.js").get(), app_data);
+    EXPECT_EQ(get("js/app.js", "Accept-Encoding", "gzip"), app_gzip);
+    EXPECT_EQ(get("js/app.js", "Range", "bytes=1-3"), "lai");
+    // No modification time to compare with
+    EXPECT_EQ(get("js/app.js",
+                  "If-Modified-Since",
+                  "Fri, 01 Jan 2100 00:00:00 GMT"),
+              app_data);
+
+    try {
+        auto r = get("js/app.js", "If-None-Match", "\"app\"");
+        EXPECT_TRUE(false);
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::NOT_MODIFIED);
+    }
+    try {
+        auto r = client::getRequest(url + "missing.html").get();
+        EXPECT_TRUE(false);
+    } catch (siesta::Exception& e) {
+        EXPECT_EQ(e.status(), siesta::HttpStatus::NOT_FOUND);
+    }
+}
+
+TEST(siesta, serve_directory_removed_while_serving)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server = server::createServer("http://127.0.0.1:8080"));
+    EXPECT_NO_THROW(server->start());
+
+    server::DirectoryOptions cached;
+    cached.cache = true;
+    const std::string url = "http://127.0.0.1:8080/removed/" + file.path();
+    for (int i = 0; i < 50; ++i) {
+        auto token = server->addDirectory("/removed", file.directory(), cached);
+        std::vector<client::Response> responses;
+        for (int r = 0; r < 4; ++r) {
+            responses.push_back(client::getRequest(url, {}, 5000));
+        }
+        // Requests in progress either complete, or find nothing
+        token.reset();
+        for (auto& response : responses) {
+            try {
+                EXPECT_EQ(response.get(), j);
+            } catch (siesta::Exception& e) {
+                EXPECT_EQ(e.status(), siesta::HttpStatus::NOT_FOUND);
+            }
+        }
+    }
+}
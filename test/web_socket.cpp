@@ -2,7 +2,9 @@
 #include <siesta/client.h>
 #include <siesta/server.h>
 
+#include <atomic>
 #include <thread>
+#include <vector>
 
 using namespace siesta;
 
@@ -15,6 +17,41 @@ namespace
         MySocketImpl(server::websocket::Writer& w) : writer(w) {}
         void onMessage(const std::string& data) override { writer.send(data); }
     };
+
+    // Client connection, which notes when the server closes it
+    struct ClosingClient {
+        std::mutex m;
+        std::condition_variable cv;
+        std::atomic<bool> closed{false};
+        std::unique_ptr<client::websocket::Writer> writer;
+
+        ClosingClient(const std::string& url)
+        {
+            auto on_closed = [this](client::websocket::Writer&) {
+                std::lock_guard<std::mutex> lock(m);
+                closed = true;
+                cv.notify_one();
+            };
+            writer = client::websocket::connect(
+                url,
+                [](client::websocket::Writer&, const std::string&) {},
+                nullptr,
+                [=](client::websocket::Writer& w, const std::string&) {
+                    on_closed(w);
+                },
+                on_closed);
+        }
+
+        ~ClosingClient() { writer = nullptr; }
+
+        bool waitClosed(std::chrono::milliseconds timeout =
+                            std::chrono::milliseconds(1000))
+        {
+            std::unique_lock<std::mutex> lock(m);
+            return cv.wait_for(
+                lock, timeout, [this] { return closed.load(); });
+        }
+    };
 }  // namespace
 
 TEST(siesta, websocket_echo)
@@ -60,34 +97,39 @@ TEST(siesta, websocket_one_client_only)
                         server::createServer("http://127.0.0.1:8080", true));
     EXPECT_NO_THROW(server->start());
 
+    std::atomic<int> num_created(0);
     server::TokenHolder holder;
-    EXPECT_NO_THROW(
-        holder += server->addTextWebsocket(
-            "/socket",
-            [](server::websocket::Writer& w) { return new MySocketImpl(w); },
-            1 /* Limit to one connection */));
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket",
+                        [&](server::websocket::Writer& w) {
+                            ++num_created;
+                            return new MySocketImpl(w);
+                        },
+                        1 /* Limit to one connection */));
 
-    std::unique_ptr<client::websocket::Writer> client1;
-    std::unique_ptr<client::websocket::Writer> client2;
-
-    auto fn_read_callback = [&](client::websocket::Writer&,
-                                const std::string& data) {};
+    std::unique_ptr<ClosingClient> client1;
+    std::unique_ptr<ClosingClient> client2;
 
     // First connection ok
-    EXPECT_NO_THROW(client1 = client::websocket::connect(
-                        "ws://127.0.0.1:8080/socket", fn_read_callback));
+    EXPECT_NO_THROW(
+        client1.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
 
-    // Second connection shall fail
-    EXPECT_THROW(client2 = client::websocket::connect(
-                     "ws://127.0.0.1:8080/socket", fn_read_callback),
-                 std::runtime_error);
+    // Second connection is closed right away
+    EXPECT_NO_THROW(
+        client2.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    EXPECT_TRUE(client2->waitClosed());
+    EXPECT_FALSE(client1->closed);
+    EXPECT_EQ(num_created, 1);
 
     // Release first connection
     client1 = nullptr;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
     // Try second connection again
-    EXPECT_NO_THROW(client2 = client::websocket::connect(
-                        "ws://127.0.0.1:8080/socket", fn_read_callback));
+    EXPECT_NO_THROW(
+        client2.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    EXPECT_FALSE(client2->waitClosed(std::chrono::milliseconds(100)));
+    EXPECT_EQ(num_created, 2);
 }
 
 TEST(siesta, websocket_max_two_clients)
@@ -97,41 +139,45 @@ TEST(siesta, websocket_max_two_clients)
                         server::createServer("http://127.0.0.1:8080", true));
     EXPECT_NO_THROW(server->start());
 
+    std::atomic<int> num_created(0);
     server::TokenHolder holder;
-    EXPECT_NO_THROW(
-        holder += server->addTextWebsocket(
-            "/socket",
-            [](server::websocket::Writer& w) { return new MySocketImpl(w); },
-            2 /* Limit to two connections */));
-
-    std::unique_ptr<client::websocket::Writer> client1;
-    std::unique_ptr<client::websocket::Writer> client2;
-    std::unique_ptr<client::websocket::Writer> client3;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket",
+                        [&](server::websocket::Writer& w) {
+                            ++num_created;
+                            return new MySocketImpl(w);
+                        },
+                        2 /* Limit to two connections */));
 
-    auto fn_read_callback = [&](client::websocket::Writer&,
-                                const std::string& data) {};
+    std::unique_ptr<ClosingClient> client1;
+    std::unique_ptr<ClosingClient> client2;
+    std::unique_ptr<ClosingClient> client3;
 
     // First connection ok
-    EXPECT_NO_THROW(client1 = client::websocket::connect(
-                        "ws://127.0.0.1:8080/socket", fn_read_callback));
+    EXPECT_NO_THROW(
+        client1.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
 
     // Second connection too
-    EXPECT_NO_THROW(client2 = client::websocket::connect(
-                        "ws://127.0.0.1:8080/socket", fn_read_callback));
+    EXPECT_NO_THROW(
+        client2.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
 
-    // Third connection though shall fail
-    EXPECT_THROW(client3 = client::websocket::connect(
-                     "ws://127.0.0.1:8080/socket", fn_read_callback),
-                 std::runtime_error);
+    // Third connection though is closed right away
+    EXPECT_NO_THROW(
+        client3.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    EXPECT_TRUE(client3->waitClosed());
+    EXPECT_FALSE(client1->closed);
+    EXPECT_FALSE(client2->closed);
+    EXPECT_EQ(num_created, 2);
 
     // Release first connection
     client1 = nullptr;
-
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
     // Try third connection again
-    EXPECT_NO_THROW(client3 = client::websocket::connect(
-                        "ws://127.0.0.1:8080/socket", fn_read_callback));
+    EXPECT_NO_THROW(
+        client3.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    EXPECT_FALSE(client3->waitClosed(std::chrono::milliseconds(100)));
+    EXPECT_EQ(num_created, 3);
 }
 
 TEST(siesta, websocket_open_close_client)
@@ -253,3 +299,736 @@ TEST(siesta, websocket_no_open_close)
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     EXPECT_FALSE(close_called);
 }
+
+TEST(siesta, websocket_queued_send)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    const int num_threads  = 4;
+    const int num_messages = 250;
+    std::atomic<int> sent(0);
+
+    // Sends from several threads at once, without waiting for the messages
+    // to be written
+    struct Sender : server::websocket::Reader {
+        server::websocket::Writer& writer;
+        std::atomic<int>& sent;
+        Sender(server::websocket::Writer& w, std::atomic<int>& s)
+            : writer(w), sent(s)
+        {
+        }
+        void onMessage(const std::string&) override
+        {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < num_threads; ++t) {
+                threads.emplace_back([this] {
+                    for (int i = 0; i < num_messages; ++i) {
+                        writer.send("0123456789", [this](bool ok) {
+                            if (ok) {
+                                ++sent;
+                            }
+                        });
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+    };
+
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket", [&](server::websocket::Writer& w) {
+                            return new Sender(w, sent);
+                        }));
+
+    std::mutex m;
+    std::condition_variable cv;
+    size_t received = 0;
+    const size_t expected = num_threads * num_messages * 10;
+    auto fn_read_callback = [&](client::websocket::Writer&,
+                                const std::string& data) {
+        std::lock_guard<std::mutex> lock(m);
+        received += data.size();
+        cv.notify_one();
+    };
+
+    std::unique_ptr<client::websocket::Writer> client;
+    EXPECT_NO_THROW(client = client::websocket::connect(
+                        "ws://127.0.0.1:8080/socket", fn_read_callback));
+    EXPECT_NO_THROW(client->send("go"));
+
+    std::unique_lock<std::mutex> lock(m);
+    EXPECT_TRUE(cv.wait_for(lock, std::chrono::seconds(5), [&] {
+        return received == expected;
+    }));
+    EXPECT_EQ(received, expected);
+    lock.unlock();
+
+    // Completions may trail the data a little
+    for (int i = 0; i < 100 && sent.load() < num_threads * num_messages;
+         ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(sent.load(), num_threads * num_messages);
+}
+
+TEST(siesta, websocket_group_broadcast)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    auto group = server::websocket::createGroup();
+
+    // Every connection joins the group
+    struct Member : server::websocket::Reader {
+        void onMessage(const std::string&) override {}
+    };
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket", [&](server::websocket::Writer& w) {
+                            group->add(w);
+                            return new Member;
+                        }));
+
+    const size_t num_clients = 3;
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<size_t> received(num_clients);
+    std::vector<std::unique_ptr<client::websocket::Writer>> clients;
+    for (size_t i = 0; i < num_clients; ++i) {
+        clients.push_back(client::websocket::connect(
+            "ws://127.0.0.1:8080/socket",
+            [&, i](client::websocket::Writer&, const std::string& data) {
+                std::lock_guard<std::mutex> lock(m);
+                received[i] += data.size();
+                cv.notify_one();
+            }));
+    }
+    for (int i = 0; i < 100 && group->size() < num_clients; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(group->size(), num_clients);
+
+    auto update = std::make_shared<const std::string>("update");
+    EXPECT_EQ(group->broadcast(update), num_clients);
+    {
+        std::unique_lock<std::mutex> lock(m);
+        EXPECT_TRUE(cv.wait_for(lock, std::chrono::seconds(1), [&] {
+            for (auto n : received) {
+                if (n != update->size()) {
+                    return false;
+                }
+            }
+            return true;
+        }));
+    }
+
+    // Closed connections leave the group
+    clients.pop_back();
+    for (int i = 0; i < 100 && group->size() == num_clients; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(group->broadcast(update), num_clients - 1);
+}
+
+TEST(siesta, websocket_ordered_delivery)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    // Messages of a connection are handled one at a time, in order
+    struct Recorder : server::websocket::Reader {
+        std::string& log;
+        std::atomic<bool>& overlap;
+        std::atomic<bool> busy{false};
+        Recorder(std::string& l, std::atomic<bool>& o) : log(l), overlap(o)
+        {
+        }
+        void onMessage(const std::string& data) override
+        {
+            if (busy.exchange(true)) {
+                overlap = true;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            log += data;
+            busy = false;
+        }
+    };
+
+    std::string log;
+    std::atomic<bool> overlap(false);
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket", [&](server::websocket::Writer&) {
+                            return new Recorder(log, overlap);
+                        }));
+
+    std::unique_ptr<client::websocket::Writer> client;
+    EXPECT_NO_THROW(client = client::websocket::connect(
+                        "ws://127.0.0.1:8080/socket",
+                        [](client::websocket::Writer&, const std::string&) {}));
+    std::string expected;
+    for (int i = 0; i < 200; ++i) {
+        const std::string message = std::to_string(i) + ",";
+        expected += message;
+        client->send(message);
+    }
+
+    // Done once the connection is closed and disposed
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    client = nullptr;
+    holder.clear();
+    EXPECT_EQ(log, expected);
+    EXPECT_FALSE(overlap);
+}
+
+TEST(siesta, websocket_large_message)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    server::websocket::Options options;
+    options.max_message_size = 256 * 1024;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addBinaryWebsocket(
+                        "/socket",
+                        [](server::websocket::Writer& w) {
+                            return new MySocketImpl(w);
+                        },
+                        options));
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::string> received;
+    bool closed = false;
+    std::unique_ptr<client::websocket::Writer> client;
+    EXPECT_NO_THROW(
+        client = client::websocket::connect(
+            "ws://127.0.0.1:8080/socket",
+            [&](client::websocket::Writer&, const std::string& data) {
+                std::lock_guard<std::mutex> lock(m);
+                received.push_back(data);
+                cv.notify_one();
+            },
+            nullptr,
+            [&](client::websocket::Writer&, const std::string&) {
+                std::lock_guard<std::mutex> lock(m);
+                closed = true;
+                cv.notify_one();
+            },
+            [&](client::websocket::Writer&) {
+                std::lock_guard<std::mutex> lock(m);
+                closed = true;
+                cv.notify_one();
+            },
+            false));
+
+    // Larger than any single read, delivered whole
+    std::string large(200 * 1024, '\0');
+    for (size_t i = 0; i < large.size(); ++i) {
+        large[i] = (char)(i * 7);
+    }
+    // Small messages keep their boundaries
+    const std::vector<std::string> small{"a", "bc", "def"};
+    EXPECT_NO_THROW(client->send(large));
+    for (auto& message : small) {
+        EXPECT_NO_THROW(client->send(message));
+    }
+    {
+        std::unique_lock<std::mutex> lock(m);
+        EXPECT_TRUE(cv.wait_for(lock, std::chrono::milliseconds(2000), [&] {
+            return received.size() == 1 + small.size();
+        }));
+        ASSERT_EQ(received.size(), 1 + small.size());
+        EXPECT_TRUE(received[0] == large);
+        for (size_t i = 0; i < small.size(); ++i) {
+            EXPECT_EQ(received[i + 1], small[i]);
+        }
+    }
+
+    // Larger than the max message size, the connection is closed
+    EXPECT_NO_THROW(client->send(std::string(300 * 1024, 'x')));
+    std::unique_lock<std::mutex> lock(m);
+    EXPECT_TRUE(cv.wait_for(
+        lock, std::chrono::milliseconds(2000), [&] { return closed; }));
+}
+
+TEST(siesta, websocket_factory_does_not_block_rest)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    // A factory stuck until released
+    std::mutex m;
+    std::condition_variable cv;
+    bool entered  = false;
+    bool released = false;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket", [&](server::websocket::Writer& w) {
+                            std::unique_lock<std::mutex> lock(m);
+                            entered = true;
+                            cv.notify_all();
+                            cv.wait(lock, [&] { return released; });
+                            return new MySocketImpl(w);
+                        }));
+
+    std::unique_ptr<client::websocket::Writer> client;
+    EXPECT_NO_THROW(client = client::websocket::connect(
+                        "ws://127.0.0.1:8080/socket",
+                        [](client::websocket::Writer&, const std::string&) {}));
+    {
+        std::unique_lock<std::mutex> lock(m);
+        EXPECT_TRUE(cv.wait_for(lock, std::chrono::milliseconds(1000), [&] {
+            return entered;
+        }));
+    }
+
+    // Routes are added and served meanwhile
+    EXPECT_NO_THROW(holder += server->addRoute(
+                        siesta::HttpMethod::GET,
+                        "/ping",
+                        [](const server::rest::Request&,
+                           server::rest::Response& resp) {
+                            resp.setBody("pong");
+                        }));
+    std::string result;
+    EXPECT_NO_THROW(
+        result = client::getRequest("http://127.0.0.1:8080/ping").get());
+    EXPECT_EQ(result, "pong");
+
+    {
+        std::lock_guard<std::mutex> lock(m);
+        released = true;
+    }
+    cv.notify_all();
+}
+
+namespace
+{
+    // Floods a client that stops reading after its first message, with a
+    // queue limit of a few messages
+    struct SlowConsumer {
+        std::shared_ptr<server::Server> server;
+        server::TokenHolder holder;
+        std::shared_ptr<server::websocket::OverflowCounters> counters{
+            std::make_shared<server::websocket::OverflowCounters>()};
+        std::atomic<server::websocket::Writer*> writer{nullptr};
+
+        std::mutex m;
+        std::condition_variable cv;
+        bool reading{false};
+        bool closed{false};
+        std::vector<std::string> received;
+        std::unique_ptr<client::websocket::Writer> client;
+
+        SlowConsumer(server::websocket::OverflowPolicy policy)
+        {
+            server = server::createServer("http://127.0.0.1:8080", true);
+            server->start();
+            server::websocket::Options options;
+            options.max_queued_messages = 4;
+            options.overflow_policy     = policy;
+            options.overflow_counters   = counters;
+            holder += server->addBinaryWebsocket(
+                "/socket",
+                [this](server::websocket::Writer& w) {
+                    writer = &w;
+                    return new MySocketImpl(w);
+                },
+                options);
+
+            auto on_closed = [this](client::websocket::Writer&) {
+                std::lock_guard<std::mutex> lock(m);
+                closed = true;
+                cv.notify_all();
+            };
+            client = client::websocket::connect(
+                "ws://127.0.0.1:8080/socket",
+                [this](client::websocket::Writer&, const std::string& data) {
+                    std::unique_lock<std::mutex> lock(m);
+                    received.push_back(data.substr(0, data.find(':')));
+                    cv.wait(lock, [this] { return reading || closed; });
+                },
+                nullptr,
+                [=](client::websocket::Writer& w, const std::string&) {
+                    on_closed(w);
+                },
+                on_closed,
+                false);
+            while (writer == nullptr) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        ~SlowConsumer()
+        {
+            read();
+            client = nullptr;
+        }
+
+        // Send more than the client and the network buffers take
+        void flood(const std::string& key = std::string())
+        {
+            const std::string filler(256 * 1024, 'x');
+            for (int i = 0; i < 200; ++i) {
+                auto data = std::make_shared<const std::string>(
+                    std::to_string(i) + ":" + filler);
+                if (key.empty()) {
+                    writer.load()->send(data);
+                } else {
+                    writer.load()->sendKeyed(key, data);
+                }
+            }
+        }
+
+        // Let the client read again
+        void read()
+        {
+            std::lock_guard<std::mutex> lock(m);
+            reading = true;
+            cv.notify_all();
+        }
+
+        // Wait for the message sent last
+        bool waitLast()
+        {
+            std::unique_lock<std::mutex> lock(m);
+            return cv.wait_for(lock, std::chrono::milliseconds(5000), [this] {
+                return !received.empty() && received.back() == "199";
+            });
+        }
+    };
+}  // namespace
+
+TEST(siesta, websocket_overflow_drop_oldest)
+{
+    SlowConsumer consumer(server::websocket::OverflowPolicy::DropOldest);
+    consumer.flood();
+    EXPECT_GT(consumer.counters->dropped_oldest, 0U);
+    EXPECT_EQ(consumer.counters->disconnected, 0U);
+    // The newest messages are kept
+    consumer.read();
+    EXPECT_TRUE(consumer.waitLast());
+}
+
+TEST(siesta, websocket_overflow_coalesce)
+{
+    SlowConsumer consumer(server::websocket::OverflowPolicy::Coalesce);
+    consumer.flood("topic");
+    EXPECT_GT(consumer.counters->coalesced, 0U);
+    EXPECT_EQ(consumer.counters->dropped_oldest, 0U);
+    // The latest message of the key is kept
+    consumer.read();
+    EXPECT_TRUE(consumer.waitLast());
+}
+
+TEST(siesta, websocket_overflow_disconnect)
+{
+    SlowConsumer consumer(server::websocket::OverflowPolicy::Disconnect);
+    consumer.flood();
+    EXPECT_EQ(consumer.counters->disconnected, 1U);
+    consumer.read();
+    std::unique_lock<std::mutex> lock(consumer.m);
+    EXPECT_TRUE(consumer.cv.wait_for(lock,
+                                     std::chrono::milliseconds(5000),
+                                     [&] { return consumer.closed; }));
+}
+
+TEST(siesta, websocket_group_broadcast_blocked)
+{
+    auto server = server::createServer("http://127.0.0.1:8080", true);
+    server->start();
+
+    auto group    = server::websocket::createGroup();
+    auto counters = std::make_shared<server::websocket::OverflowCounters>();
+    server::websocket::Options options;
+    options.max_queued_messages = 4;
+    options.overflow_policy     = server::websocket::OverflowPolicy::Block;
+    options.overflow_counters   = counters;
+    server::TokenHolder holder;
+    holder += server->addBinaryWebsocket(
+        "/socket",
+        [&](server::websocket::Writer& w) {
+            group->add(w);
+            return new MySocketImpl(w);
+        },
+        options);
+
+    // One client stops reading after its first message, the other reads on
+    std::mutex m;
+    std::condition_variable cv;
+    bool reading{false};
+    size_t fast_received{0};
+    auto slow = client::websocket::connect(
+        "ws://127.0.0.1:8080/socket",
+        [&](client::websocket::Writer&, const std::string&) {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&] { return reading; });
+        });
+    auto fast = client::websocket::connect(
+        "ws://127.0.0.1:8080/socket",
+        [&](client::websocket::Writer&, const std::string&) {
+            std::lock_guard<std::mutex> lock(m);
+            ++fast_received;
+            cv.notify_all();
+        });
+    for (int i = 0; i < 100 && group->size() < 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(group->size(), 2U);
+
+    std::atomic<size_t> broadcasts{0};
+    std::thread broadcaster([&] {
+        const auto data =
+            std::make_shared<const std::string>(256 * 1024, 'x');
+        for (int i = 0; i < 200; ++i) {
+            ++broadcasts;
+            group->broadcast(data);
+        }
+    });
+    for (int i = 0; i < 500 && counters->blocked == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_GT(counters->blocked, 0U);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // The message waiting for the slow client reached the fast one
+    {
+        std::unique_lock<std::mutex> lock(m);
+        EXPECT_TRUE(cv.wait_for(lock, std::chrono::milliseconds(5000), [&] {
+            return fast_received == broadcasts;
+        }));
+        reading = true;
+        cv.notify_all();
+    }
+    broadcaster.join();
+    slow = nullptr;
+    fast = nullptr;
+}
+
+TEST(siesta, websocket_heartbeat)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    server::websocket::Options options;
+    options.heartbeat_interval_ms = 200;
+    options.heartbeat_message     = "heartbeat";
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket",
+                        [](server::websocket::Writer& w) {
+                            return new MySocketImpl(w);
+                        },
+                        options));
+
+    std::mutex m;
+    std::condition_variable cv;
+    int num_heartbeats = 0;
+    std::unique_ptr<client::websocket::Writer> client;
+    EXPECT_NO_THROW(
+        client = client::websocket::connect(
+            "ws://127.0.0.1:8080/socket",
+            [&](client::websocket::Writer&, const std::string& data) {
+                std::lock_guard<std::mutex> lock(m);
+                num_heartbeats += data == "heartbeat" ? 1 : 0;
+                cv.notify_one();
+            }));
+
+    std::unique_lock<std::mutex> lock(m);
+    EXPECT_TRUE(cv.wait_for(lock, std::chrono::milliseconds(2000), [&] {
+        return num_heartbeats >= 2;
+    }));
+}
+
+TEST(siesta, websocket_idle_timeout)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    server::websocket::Options options;
+    options.idle_timeout_ms = 500;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket",
+                        [](server::websocket::Writer& w) {
+                            return new MySocketImpl(w);
+                        },
+                        options));
+
+    std::unique_ptr<ClosingClient> active;
+    std::unique_ptr<ClosingClient> idle;
+    EXPECT_NO_THROW(
+        active.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    EXPECT_NO_THROW(
+        idle.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+
+    // Only the client sending nothing is closed
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_NO_THROW(active->writer->send("still here"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_TRUE(idle->waitClosed());
+    EXPECT_FALSE(active->closed);
+}
+
+TEST(siesta, websocket_disconnect_storm)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    // Counts the live handlers
+    struct Counted : MySocketImpl {
+        std::atomic<int>& live;
+        Counted(server::websocket::Writer& w, std::atomic<int>& l)
+            : MySocketImpl(w), live(l)
+        {
+            ++live;
+        }
+        ~Counted() { --live; }
+    };
+
+    std::atomic<int> live(0);
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket", [&](server::websocket::Writer& w) {
+                            return new Counted(w, live);
+                        }));
+
+    // Connections closing while messages are in flight, all disposed of
+    // without hanging
+    for (int i = 0; i < 200; ++i) {
+        std::unique_ptr<client::websocket::Writer> client;
+        EXPECT_NO_THROW(client = client::websocket::connect(
+                            "ws://127.0.0.1:8080/socket",
+                            [](client::websocket::Writer&,
+                               const std::string&) {}));
+        EXPECT_NO_THROW(client->send("bye"));
+    }
+    for (int i = 0; i < 500 && live > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(live, 0);
+}
+
+TEST(siesta, websocket_removed_with_queued_messages)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    // Slow enough for messages to queue up behind it
+    struct Slow : server::websocket::Reader {
+        std::atomic<int>& handled;
+        std::atomic<bool>& destroyed;
+        Slow(std::atomic<int>& h, std::atomic<bool>& d)
+            : handled(h), destroyed(d)
+        {
+        }
+        ~Slow() { destroyed = true; }
+        void onMessage(const std::string&) override
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            ++handled;
+        }
+    };
+
+    std::atomic<int> handled(0);
+    std::atomic<bool> destroyed(false);
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket", [&](server::websocket::Writer&) {
+                            return new Slow(handled, destroyed);
+                        }));
+
+    std::unique_ptr<client::websocket::Writer> client;
+    EXPECT_NO_THROW(client = client::websocket::connect(
+                        "ws://127.0.0.1:8080/socket",
+                        [](client::websocket::Writer&, const std::string&) {
+                        }));
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_NO_THROW(client->send("message"));
+    }
+    for (int i = 0; i < 100 && handled == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // The handler is gone once the endpoint is, and the queued messages
+    // are dropped
+    holder.clear();
+    EXPECT_TRUE(destroyed);
+    const int after_removal = handled;
+    EXPECT_LT(after_removal, 20);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(handled, after_removal);
+}
+
+TEST(siesta, websocket_heartbeat_idle_timeout)
+{
+    std::shared_ptr<server::Server> server;
+    EXPECT_NO_THROW(server =
+                        server::createServer("http://127.0.0.1:8080", true));
+    EXPECT_NO_THROW(server->start());
+
+    server::websocket::Options options;
+    options.heartbeat_interval_ms = 100;
+    options.idle_timeout_ms       = 500;
+    server::TokenHolder holder;
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/silent",
+                        [](server::websocket::Writer& w) {
+                            return new MySocketImpl(w);
+                        },
+                        options));
+    options.heartbeat_message = "heartbeat";
+    EXPECT_NO_THROW(holder += server->addTextWebsocket(
+                        "/socket",
+                        [](server::websocket::Writer& w) {
+                            return new MySocketImpl(w);
+                        },
+                        options));
+
+    // No heartbeat without a message, and the idle timeout still applies
+    std::unique_ptr<ClosingClient> silent;
+    EXPECT_NO_THROW(
+        silent.reset(new ClosingClient("ws://127.0.0.1:8080/silent")));
+    EXPECT_TRUE(silent->waitClosed());
+
+    // Heartbeats don't count as received, a client that only listens is
+    // closed
+    std::unique_ptr<ClosingClient> listener;
+    EXPECT_NO_THROW(
+        listener.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    EXPECT_TRUE(listener->waitClosed());
+
+    // Answering heartbeats keeps it open
+    std::unique_ptr<ClosingClient> answering;
+    EXPECT_NO_THROW(
+        answering.reset(new ClosingClient("ws://127.0.0.1:8080/socket")));
+    for (int i = 0; i < 10; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        EXPECT_NO_THROW(answering->writer->send("pong"));
+    }
+    EXPECT_FALSE(answering->closed);
+}